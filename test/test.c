@@ -32,6 +32,15 @@
 #include <linux/usb.h>
 #include <linux/fs.h>
 #include <linux/device.h>
+#include <linux/mm.h>
+#include <linux/hrtimer.h>
+#ifdef TEST_EVENTFD_CTX
+#	include <linux/eventfd.h>
+#endif
+#ifdef TEST_USE_MM
+#	include <linux/sched.h>
+#	include <linux/mmu_context.h>
+#endif
 #ifdef KBUILD_EXTMOD
 #	include "../usb-vhci.h"
 #else
@@ -81,6 +90,37 @@ static int __init init(void)
 	dev_set_name((struct device *)NULL, foo);
 #endif
 
+#ifdef TEST_KMEM_CACHE_CREATE
+	kmem_cache_destroy(kmem_cache_create("test", 8, 0, 0, NULL));
+#endif
+
+#ifdef TEST_ZAP_VMA_PTES
+	int (*zap)(struct vm_area_struct *, unsigned long, unsigned long) = zap_vma_ptes;
+	zap((struct vm_area_struct *)NULL, 0, 0);
+#endif
+
+#ifdef TEST_HRTIMER_MODE
+	struct hrtimer t;
+	hrtimer_init(&t, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+#endif
+
+#ifdef TEST_HRTIMER_ON_STACK
+	struct hrtimer t2;
+	hrtimer_init_on_stack(&t2, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	destroy_hrtimer_on_stack(&t2);
+#endif
+
+#ifdef TEST_EVENTFD_CTX
+	struct eventfd_ctx *ctx = eventfd_ctx_fdget(0);
+	if(!IS_ERR(ctx))
+		eventfd_ctx_put(ctx);
+#endif
+
+#ifdef TEST_USE_MM
+	use_mm(current->mm);
+	unuse_mm(current->mm);
+#endif
+
 	return 0;
 }
 module_init(init);
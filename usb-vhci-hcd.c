@@ -27,6 +27,7 @@
 #include <linux/slab.h>
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
+#include <linux/mempool.h>
 #include <linux/errno.h>
 #include <linux/init.h>
 #include <linux/timer.h>
@@ -79,6 +80,13 @@ static const char driver_desc[] = DRIVER_DESC;
 static unsigned int debug_output = 0;
 #endif
 
+// slab cache for struct usb_vhci_urb_priv (shared by all controllers)
+static struct kmem_cache *urbp_cache;
+
+// number of urbp's which are reserved in the mempool of a controller (per port, plus one for the
+// root hub), so that urbs can always be enqueued, even under memory pressure
+#define USB_VHCI_URBP_POOL_PER_PORT 8
+
 MODULE_DESCRIPTION(DRIVER_DESC " driver");
 MODULE_AUTHOR("Michael Singer <michael@a-singer.de>");
 MODULE_LICENSE("GPL");
@@ -148,14 +156,111 @@ static void vhci_port_update(struct usb_vhci_hcd *vhc, u8 port)
 {
 	struct usb_vhci_device *vdev = vhcihcd_to_vhcidev(vhc);
 	vhc->port_update |= 1 << port;
+	usb_vhci_update_work_pending(vhc);
 	vdev->ifc->wakeup(vdev);
 }
 
-// gives the urb back to its original owner/creator.
+// initial number of entries of the handle table; the table doubles its size whenever it runs full
+#define USB_VHCI_INITIAL_SLOTS 64
+// upper limit for the number of urbs, which can be enqueued at the same time
+// (older kernels can't kmalloc more than 128 KiB at once)
+#define USB_VHCI_MAX_SLOTS     (0x20000 / sizeof(struct usb_vhci_urb_slot))
+
+// caller doesn't have vhc->lock; the table may have been grown by someone else
+// since old_count was read, in which case nothing is done
+static int vhci_grow_slots(struct usb_vhci_hcd *vhc, u32 old_count, gfp_t mem_flags)
+{
+	struct usb_vhci_urb_slot *slots, *old_slots;
+	unsigned long flags;
+	u32 i, new_count = old_count * 2;
+
+	if(unlikely(new_count > USB_VHCI_MAX_SLOTS))
+		return -ENOMEM;
+
+	slots = kmalloc(new_count * sizeof *slots, mem_flags);
+	if(unlikely(!slots))
+		return -ENOMEM;
+
+	spin_lock_irqsave(&vhc->lock, flags);
+	if(likely(vhc->slot_count == old_count))
+	{
+		memcpy(slots, vhc->slots, old_count * sizeof *slots);
+		for(i = old_count; i < new_count; i++)
+		{
+			slots[i].urbp = NULL;
+			slots[i].generation = 1;
+			slots[i].next_free = i + 1;
+		}
+		// append the current free-list (which might not be empty anymore) to the new slots
+		slots[new_count - 1].next_free = vhc->slot_free;
+		vhc->slot_free = old_count;
+		old_slots = vhc->slots;
+		vhc->slots = slots;
+		vhc->slot_count = new_count;
+		slots = old_slots;
+	}
+	spin_unlock_irqrestore(&vhc->lock, flags);
+
+	kfree(slots);
+	return 0;
+}
+
+// caller has vhc->lock and made sure that there is a free slot
+static inline void vhci_alloc_slot(struct usb_vhci_hcd *vhc, struct usb_vhci_urb_priv *urbp)
+{
+	const u32 i = vhc->slot_free;
+	struct usb_vhci_urb_slot *const slot = &vhc->slots[i];
+	vhc->slot_free = slot->next_free;
+	slot->urbp = urbp;
+	urbp->handle = ((u64)slot->generation << 32) | i;
+}
+
+// caller has vhc->lock
+static inline void vhci_free_slot(struct usb_vhci_hcd *vhc, struct usb_vhci_urb_priv *urbp)
+{
+	const u32 i = (u32)urbp->handle;
+	struct usb_vhci_urb_slot *const slot = &vhc->slots[i];
+	slot->urbp = NULL;
+	// a generation of zero is never used, so that no valid handle is zero
+	if(unlikely(!++slot->generation))
+		slot->generation = 1;
+	slot->next_free = vhc->slot_free;
+	vhc->slot_free = i;
+}
+
+// Returns the urb which belongs to the handle, or NULL if the handle is unknown or stale.
+// The caller has to check urbp->state.
+// caller has vhc->lock
+struct usb_vhci_urb_priv *usb_vhci_urbp_from_handle(struct usb_vhci_hcd *vhc, u64 handle)
+{
+	const u32 i = (u32)handle;
+	const struct usb_vhci_urb_slot *slot;
+
+	if(unlikely(i >= vhc->slot_count))
+		return NULL;
+	slot = &vhc->slots[i];
+	if(unlikely(!slot->urbp || slot->generation != (u32)(handle >> 32)))
+		return NULL;
+	return slot->urbp;
+}
+EXPORT_SYMBOL_GPL(usb_vhci_urbp_from_handle);
+
+// detaches the urb from the hcd, so that it can be given back by vhci_urb_complete.
+// (the urb must not be in one of the urb lists anymore.)
 // caller owns vhc->lock and has irq disabled.
-void usb_vhci_urb_giveback(struct usb_vhci_hcd *vhc, struct usb_vhci_urb_priv *urbp)
+static inline void vhci_urb_detach(struct usb_vhci_hcd *vhc, struct usb_vhci_urb_priv *urbp)
+{
+	urbp->urb->hcpriv = NULL;
+	vhci_free_slot(vhc, urbp);
+#ifndef OLD_GIVEBACK_MECH
+	usb_hcd_unlink_urb_from_ep(vhcihcd_to_usbhcd(vhc), urbp->urb);
+#endif
+}
+
+// returns a detached urb to its creator and frees its private data.
+// caller must not own vhc->lock.
+static void vhci_urb_complete(struct usb_vhci_hcd *vhc, struct usb_vhci_urb_priv *urbp)
 {
-	struct device *dev;
 	struct usb_hcd *hcd;
 	struct urb *const urb = urbp->urb;
 	struct usb_device *const udev = urb->dev;
@@ -163,18 +268,10 @@ void usb_vhci_urb_giveback(struct usb_vhci_hcd *vhc, struct usb_vhci_urb_priv *u
 	int status;
 #endif
 	hcd = vhcihcd_to_usbhcd(vhc);
-	dev = vhcihcd_to_dev(vhc);
-	trace_function(dev);
 #ifndef OLD_GIVEBACK_MECH
 	status = atomic_read(&urbp->status);
 #endif
-	urb->hcpriv = NULL;
-	list_del(&urbp->urbp_list);
-#ifndef OLD_GIVEBACK_MECH
-	usb_hcd_unlink_urb_from_ep(hcd, urb);
-#endif
-	spin_unlock(&vhc->lock);
-	kfree(urbp);
+	mempool_free(urbp, vhc->urbp_pool);
 	dump_urb(urb);
 #ifdef OLD_GIVEBACK_MECH
 	usb_hcd_giveback_urb(hcd, urb);
@@ -185,10 +282,134 @@ void usb_vhci_urb_giveback(struct usb_vhci_hcd *vhc, struct usb_vhci_urb_priv *u
 	usb_hcd_giveback_urb(hcd, urb, status);
 #endif
 	usb_put_dev(udev);
+}
+
+// gives the urb back to its original owner/creator.
+// caller owns vhc->lock and has irq disabled.
+void usb_vhci_urb_giveback(struct usb_vhci_hcd *vhc, struct usb_vhci_urb_priv *urbp)
+{
+	trace_function(vhcihcd_to_dev(vhc));
+	if(urbp->state == USB_VHCI_URB_STATE_INBOX)
+		usb_vhci_inbox_del(vhc, urbp);
+	else
+		list_del(&urbp->urbp_list);
+	usb_vhci_update_work_pending(vhc);
+	vhci_urb_detach(vhc, urbp);
+	spin_unlock(&vhc->lock);
+	vhci_urb_complete(vhc, urbp);
 	spin_lock(&vhc->lock);
 }
 EXPORT_SYMBOL_GPL(usb_vhci_urb_giveback);
 
+// gives back all urbs which are linked (through urbp_list) into the given list. The lock is
+// released only once for the whole list. The list is empty when this function returns.
+// caller owns vhc->lock and has irq disabled.
+void usb_vhci_urb_giveback_list(struct usb_vhci_hcd *vhc, struct list_head *list)
+{
+	struct usb_vhci_urb_priv *urbp, *tmp;
+	LIST_HEAD(done);
+	trace_function(vhcihcd_to_dev(vhc));
+	if(list_empty(list))
+		return;
+	list_splice_init(list, &done);
+	list_for_each_entry(urbp, &done, urbp_list)
+		vhci_urb_detach(vhc, urbp);
+	spin_unlock(&vhc->lock);
+	list_for_each_entry_safe(urbp, tmp, &done, urbp_list)
+		vhci_urb_complete(vhc, urbp);
+	spin_lock(&vhc->lock);
+}
+EXPORT_SYMBOL_GPL(usb_vhci_urb_giveback_list);
+
+// cost of the next urb of the port for the deficit round-robin
+// caller has vhc->lock
+static inline unsigned int vhci_inbox_cost(struct usb_vhci_port *port, int prio)
+{
+	struct usb_vhci_ep_queue *epq;
+	struct usb_vhci_urb_priv *urbp;
+	epq = list_entry(port->ep_ready_list[prio].next, struct usb_vhci_ep_queue, ready_list);
+	urbp = list_entry(epq->urbp_list.next, struct usb_vhci_urb_priv, urbp_list);
+	return urbp->urb->transfer_buffer_length + USB_VHCI_DRR_URB_COST;
+}
+
+// Returns the urb which should be fetched next or NULL if there is none. Its endpoint goes to the
+// end of the round of its port. With prio_sched, the classes are served in order of priority,
+// but a class which has been passed over prio_aging times is served once before the others, so
+// that bulk transfers still make progress while periodic transfers keep coming in.
+// Within a class, the ports are served by deficit round-robin, so each port gets a share of
+// the transferred bytes according to its weight, no matter how many urbs it has queued.
+// caller has vhc->lock
+struct usb_vhci_urb_priv *usb_vhci_inbox_next(struct usb_vhci_hcd *vhc)
+{
+	struct usb_vhci_port *port, *best = NULL;
+	struct usb_vhci_ep_queue *epq;
+	struct usb_vhci_urb_priv *urbp;
+	unsigned int rounds, best_rounds = 0, passed;
+	int i, prio = -1;
+
+	for(i = 0; i < USB_VHCI_PRIO_COUNT; i++)
+	{
+		if(list_empty(&vhc->port_ready_list[i]))
+			continue;
+		if(prio < 0)
+			prio = i;
+		else if(vhc->prio_aging && vhc->prio_skipped[i] >= vhc->prio_aging)
+		{
+			prio = i;
+			break;
+		}
+	}
+	if(prio < 0)
+		return NULL;
+
+	for(i = 0; i < USB_VHCI_PRIO_COUNT; i++)
+	{
+		if(i == prio || list_empty(&vhc->port_ready_list[i]))
+			vhc->prio_skipped[i] = 0;
+		else if(vhc->prio_aging)
+			vhc->prio_skipped[i]++;
+	}
+
+	// Deficit round-robin: the port at the head of the round is served if its deficit covers the
+	// cost of its next urb; otherwise it gets its quantum and goes to the end of the round.
+	// Instead of going round by round, the number of rounds until the first port can be served
+	// is computed for every port, so this doesn't depend on the size of the urbs.
+	list_for_each_entry(port, &vhc->port_ready_list[prio], ready_list[prio])
+	{
+		unsigned int cost = vhci_inbox_cost(port, prio);
+		unsigned int quantum = port->weight * USB_VHCI_DRR_QUANTUM;
+		if(port->deficit[prio] >= cost)
+			rounds = 0;
+		else
+			rounds = (cost - port->deficit[prio] + quantum - 1) / quantum;
+		if(!best || rounds < best_rounds)
+		{
+			best = port;
+			best_rounds = rounds;
+			if(!rounds)
+				break;
+		}
+	}
+
+	// the ports in front of the chosen one are passed over once more than the others
+	passed = 1;
+	list_for_each_entry(port, &vhc->port_ready_list[prio], ready_list[prio])
+	{
+		if(port == best)
+			passed = 0;
+		port->deficit[prio] += (best_rounds + passed) * port->weight * USB_VHCI_DRR_QUANTUM;
+	}
+	while(vhc->port_ready_list[prio].next != &best->ready_list[prio])
+		list_move_tail(vhc->port_ready_list[prio].next, &vhc->port_ready_list[prio]);
+
+	epq = list_entry(best->ep_ready_list[prio].next, struct usb_vhci_ep_queue, ready_list);
+	urbp = list_entry(epq->urbp_list.next, struct usb_vhci_urb_priv, urbp_list);
+	best->deficit[prio] -= vhci_inbox_cost(best, prio);
+	list_move_tail(&epq->ready_list, &best->ep_ready_list[prio]);
+	return urbp;
+}
+EXPORT_SYMBOL_GPL(usb_vhci_inbox_next);
+
 #ifdef OLD_GIVEBACK_MECH
 static int vhci_urb_enqueue(struct usb_hcd *hcd, struct usb_host_endpoint *ep, struct urb *urb, gfp_t mem_flags)
 #else
@@ -198,9 +419,12 @@ static int vhci_urb_enqueue(struct usb_hcd *hcd, struct urb *urb, gfp_t mem_flag
 	struct usb_vhci_hcd *vhc;
 	struct device *dev;
 	struct usb_vhci_urb_priv *urbp;
+	struct usb_vhci_ep_queue *epq = NULL;
 	struct usb_vhci_device *vdev;
 	unsigned long flags;
+	unsigned long port;
 #ifndef OLD_GIVEBACK_MECH
+	struct usb_host_endpoint *ep = urb->ep;
 	int retval;
 #endif
 
@@ -213,28 +437,84 @@ static int vhci_urb_enqueue(struct usb_hcd *hcd, struct urb *urb, gfp_t mem_flag
 	if(unlikely(!urb->transfer_buffer && urb->transfer_buffer_length))
 		return -EINVAL;
 
-	urbp = kzalloc(sizeof *urbp, mem_flags);
+	// the first urb of an endpoint brings its queue along (freed in vhci_endpoint_disable)
+	if(unlikely(!ep->hcpriv))
+	{
+		epq = kmalloc(sizeof *epq, mem_flags);
+		if(unlikely(!epq))
+			return -ENOMEM;
+		INIT_LIST_HEAD(&epq->urbp_list);
+		INIT_LIST_HEAD(&epq->ready_list);
+		switch(usb_pipetype(urb->pipe))
+		{
+		case PIPE_CONTROL: epq->prio = USB_VHCI_PRIO_CONTROL;  break;
+		case PIPE_BULK:    epq->prio = USB_VHCI_PRIO_BULK;     break;
+		default:           epq->prio = USB_VHCI_PRIO_PERIODIC; break;
+		}
+		// the devpath of the device starts with the number of the root hub port ("2" or "2.4")
+		port = simple_strtoul(urb->dev->devpath, NULL, 10);
+		epq->port = (port >= 1 && port <= vhc->port_count) ? port - 1 : 0;
+	}
+
+	urbp = mempool_alloc(vhc->urbp_pool, mem_flags);
 	if(unlikely(!urbp))
+	{
+		kfree(epq);
 		return -ENOMEM;
+	}
+	memset(urbp, 0, sizeof *urbp);
 	urbp->urb = urb;
 	atomic_set(&urbp->status, urb->status);
 
 	vhci_dbg("vhci_urb_enqueue: urb->status = %d(%s)",urb->status,get_status_str(urb->status));
 
 	spin_lock_irqsave(&vhc->lock, flags);
+	while(unlikely(vhc->slot_free == USB_VHCI_NO_SLOT))
+	{
+		u32 slot_count = vhc->slot_count;
+		spin_unlock_irqrestore(&vhc->lock, flags);
+		if(unlikely(vhci_grow_slots(vhc, slot_count, mem_flags)))
+		{
+			mempool_free(urbp, vhc->urbp_pool);
+			kfree(epq);
+			return -ENOMEM;
+		}
+		spin_lock_irqsave(&vhc->lock, flags);
+	}
 #ifndef OLD_GIVEBACK_MECH
 	retval = usb_hcd_link_urb_to_ep(hcd, urb);
 	if(unlikely(retval))
 	{
-		kfree(urbp);
 		spin_unlock_irqrestore(&vhc->lock, flags);
+		mempool_free(urbp, vhc->urbp_pool);
+		kfree(epq);
 		return retval;
 	}
 #endif
+	if(!ep->hcpriv)
+	{
+		ep->hcpriv = epq;
+		epq = NULL;
+	}
+	if(unlikely(!ep->hcpriv))
+	{
+		// ep->hcpriv was set when we checked, but the endpoint was disabled meanwhile
+#ifndef OLD_GIVEBACK_MECH
+		usb_hcd_unlink_urb_from_ep(hcd, urb);
+#endif
+		spin_unlock_irqrestore(&vhc->lock, flags);
+		mempool_free(urbp, vhc->urbp_pool);
+		return -ENOENT;
+	}
 	usb_get_dev(urb->dev);
-	list_add_tail(&urbp->urbp_list, &vhc->urbp_list_inbox);
+	vhci_alloc_slot(vhc, urbp);
+	urbp->epq = ep->hcpriv;
+	usb_vhci_inbox_add(vhc, urbp);
+	usb_vhci_update_work_pending(vhc);
 	urb->hcpriv = urbp;
 	spin_unlock_irqrestore(&vhc->lock, flags);
+	kfree(epq); // someone else was faster
+	atomic_inc(&vhc->stat_urbs);
 	vdev->ifc->wakeup(vdev);
 	return 0;
 }
@@ -249,7 +529,7 @@ static int vhci_urb_dequeue(struct usb_hcd *hcd, struct urb *urb, int status)
 	struct device *dev;
 	struct usb_vhci_device *vdev;
 	unsigned long flags;
-	struct usb_vhci_urb_priv *entry, *urbp = NULL;
+	struct usb_vhci_urb_priv *urbp;
 #ifndef OLD_GIVEBACK_MECH
 	int retval;
 #endif
@@ -270,36 +550,60 @@ static int vhci_urb_dequeue(struct usb_hcd *hcd, struct urb *urb, int status)
 	}
 #endif
 
-	// search the queue of unprocessed urbs (inbox)
-	list_for_each_entry(entry, &vhc->urbp_list_inbox, urbp_list)
+	// urb->hcpriv is cleared (with vhc->lock held) when the urb is detached, so it is valid here,
+	// and the state tells us where the urb is without searching the lists
+	urbp = urb->hcpriv;
+	if(likely(urbp))
 	{
-		if(entry->urb == urb)
+		switch(urbp->state)
 		{
-			urbp = entry;
+		case USB_VHCI_URB_STATE_INBOX:
+			// not fetched by user space yet
+			usb_vhci_urb_giveback(vhc, urbp);
+			break;
+
+		case USB_VHCI_URB_STATE_FETCHED:
+			// the urb is on a vacation through user space, so move it into the cancel list
+			usb_vhci_urb_set_state(vhc, urbp, USB_VHCI_URB_STATE_CANCEL);
+			vdev->ifc->wakeup(vdev);
+			break;
+
+		default:
+			// cancelation or giveback is in progress already
 			break;
 		}
 	}
 
-	// if found in inbox
-	if(urbp)
-		usb_vhci_urb_giveback(vhc, urbp);
-	else // if not found...
+	spin_unlock_irqrestore(&vhc->lock, flags);
+	return 0;
+}
+
+// frees the inbox of the endpoint (usbcore has flushed the endpoint already, so it should be empty)
+static void vhci_endpoint_disable(struct usb_hcd *hcd, struct usb_host_endpoint *ep)
+{
+	struct usb_vhci_hcd *vhc;
+	struct usb_vhci_ep_queue *epq;
+	struct usb_vhci_urb_priv *urbp;
+	unsigned long flags;
+
+	vhc = usbhcd_to_vhcihcd(hcd);
+
+	trace_function(vhcihcd_to_dev(vhc));
+
+	spin_lock_irqsave(&vhc->lock, flags);
+	epq = ep->hcpriv;
+	ep->hcpriv = NULL;
+	if(likely(epq))
 	{
-		// ...then check if the urb is on a vacation through user space
-		list_for_each_entry(entry, &vhc->urbp_list_fetched, urbp_list)
+		while(unlikely(!list_empty(&epq->urbp_list)))
 		{
-			if(entry->urb == urb)
-			{
-				// move it into the cancel list
-				list_move_tail(&entry->urbp_list, &vhc->urbp_list_cancel);
-				vdev->ifc->wakeup(vdev);
-				break;
-			}
+			urbp = list_entry(epq->urbp_list.next, struct usb_vhci_urb_priv, urbp_list);
+			usb_vhci_maybe_set_status(urbp, -ESHUTDOWN);
+			usb_vhci_urb_giveback(vhc, urbp);
 		}
 	}
-
 	spin_unlock_irqrestore(&vhc->lock, flags);
-	return 0;
+	kfree(epq);
 }
 
 /*
@@ -734,6 +1038,23 @@ static inline ssize_t show_urb(char *buf, size_t size, struct urb *urb)
 		urb->actual_length, urb->transfer_buffer_length);
 }
 
+// caller has vhc->lock
+static size_t show_urb_list(char *buf, size_t size, struct list_head *list)
+{
+	struct usb_vhci_urb_priv *urbp;
+	list_for_each_entry(urbp, list, urbp_list)
+	{
+		size_t temp;
+
+		temp = PAGE_SIZE - size;
+		if(unlikely(temp <= 0)) break;
+
+		temp = show_urb(buf + size, temp, urbp->urb);
+		size += temp;
+	}
+	return size;
+}
+
 static ssize_t show_urbs(struct device *dev, struct device_attribute *attr, char *buf);
 static DEVICE_ATTR(urbs_inbox,     S_IRUSR, show_urbs, NULL);
 static DEVICE_ATTR(urbs_fetched,   S_IRUSR, show_urbs, NULL);
@@ -744,10 +1065,11 @@ static ssize_t show_urbs(struct device *dev, struct device_attribute *attr, char
 {
 	struct usb_vhci_hcd *vhc;
 	struct platform_device *pdev;
-	struct usb_vhci_urb_priv *urbp;
+	struct usb_vhci_ep_queue *epq;
 	size_t size = 0;
 	unsigned long flags;
 	struct list_head *list;
+	int i, j;
 
 	pdev = to_platform_device(dev);
 	vhc = pdev_to_vhcihcd(pdev);
@@ -755,7 +1077,7 @@ static ssize_t show_urbs(struct device *dev, struct device_attribute *attr, char
 	trace_function(dev);
 
 	if(attr == &dev_attr_urbs_inbox)
-		list = &vhc->urbp_list_inbox;
+		list = NULL;
 	else if(attr == &dev_attr_urbs_fetched)
 		list = &vhc->urbp_list_fetched;
 	else if(attr == &dev_attr_urbs_cancel)
@@ -769,29 +1091,210 @@ static ssize_t show_urbs(struct device *dev, struct device_attribute *attr, char
 	}
 
 	spin_lock_irqsave(&vhc->lock, flags);
-	list_for_each_entry(urbp, list, urbp_list)
+	if(list)
+		size = show_urb_list(buf, size, list);
+	else
 	{
-		size_t temp;
+		// the inbox is split up into the queues of the endpoints
+		for(i = 0; i < vhc->port_count; i++)
+			for(j = 0; j < USB_VHCI_PRIO_COUNT; j++)
+				list_for_each_entry(epq, &vhc->ports[i].ep_ready_list[j], ready_list)
+					size = show_urb_list(buf, size, &epq->urbp_list);
+	}
+	spin_unlock_irqrestore(&vhc->lock, flags);
 
-		temp = PAGE_SIZE - size;
-		if(unlikely(temp <= 0)) break;
+	return size;
+}
 
-		temp = show_urb(buf, temp, urbp->urb);
-		buf += temp;
-		size += temp;
+static ssize_t show_stat(struct device *dev, struct device_attribute *attr, char *buf);
+static DEVICE_ATTR(urbs_enqueued,     S_IRUSR, show_stat, NULL);
+static DEVICE_ATTR(wakeups,           S_IRUSR, show_stat, NULL);
+static DEVICE_ATTR(wakeups_coalesced, S_IRUSR, show_stat, NULL);
+static DEVICE_ATTR(busy_poll_hits,    S_IRUSR, show_stat, NULL);
+static DEVICE_ATTR(busy_poll_misses,  S_IRUSR, show_stat, NULL);
+
+static ssize_t show_stat(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct usb_vhci_hcd *vhc;
+	struct platform_device *pdev;
+	atomic_t *stat;
+
+	pdev = to_platform_device(dev);
+	vhc = pdev_to_vhcihcd(pdev);
+
+	trace_function(dev);
+
+	if(attr == &dev_attr_urbs_enqueued)
+		stat = &vhc->stat_urbs;
+	else if(attr == &dev_attr_wakeups)
+		stat = &vhc->stat_wakeups;
+	else if(attr == &dev_attr_wakeups_coalesced)
+		stat = &vhc->stat_wakeups_coalesced;
+	else if(attr == &dev_attr_busy_poll_hits)
+		stat = &vhc->stat_busy_poll_hits;
+	else if(attr == &dev_attr_busy_poll_misses)
+		stat = &vhc->stat_busy_poll_misses;
+	else
+	{
+		dev_err(dev, "unreachable code reached... wtf?\n");
+		return -EINVAL;
+	}
+
+	return sprintf(buf, "%u\n", (unsigned int)atomic_read(stat));
+}
+
+static ssize_t show_inbox_depth(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct usb_vhci_hcd *vhc;
+	struct platform_device *pdev;
+	unsigned int depth[USB_VHCI_PRIO_COUNT];
+	unsigned long flags;
+
+	pdev = to_platform_device(dev);
+	vhc = pdev_to_vhcihcd(pdev);
+
+	trace_function(dev);
+
+	spin_lock_irqsave(&vhc->lock, flags);
+	memcpy(depth, vhc->inbox_depth, sizeof depth);
+	spin_unlock_irqrestore(&vhc->lock, flags);
+
+	return sprintf(buf, "periodic %u\ncontrol %u\nbulk %u\n",
+		depth[USB_VHCI_PRIO_PERIODIC], depth[USB_VHCI_PRIO_CONTROL], depth[USB_VHCI_PRIO_BULK]);
+}
+
+static DEVICE_ATTR(inbox_depth, S_IRUSR, show_inbox_depth, NULL);
+
+static ssize_t show_prio_sched(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct usb_vhci_hcd *vhc = pdev_to_vhcihcd(to_platform_device(dev));
+	return sprintf(buf, "%u\n", vhc->prio_sched);
+}
+
+static ssize_t store_prio_sched(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct usb_vhci_hcd *vhc;
+	struct usb_vhci_port *port;
+	struct usb_vhci_ep_queue *epq;
+	unsigned long flags;
+	LIST_HEAD(ready);
+	int i, j, on;
+
+	vhc = pdev_to_vhcihcd(to_platform_device(dev));
+
+	if(count < 1 || buf == NULL) return -EINVAL;
+	switch(*buf)
+	{
+	case '0': on = 0; break;
+	case '1': on = 1; break;
+	default: return -EINVAL;
+	}
+
+	spin_lock_irqsave(&vhc->lock, flags);
+	if(on != vhc->prio_sched)
+	{
+		// sort the ready endpoints into the lists of the new mode (keeping their order per port)
+		for(i = 0; i < vhc->port_count; i++)
+		{
+			port = &vhc->ports[i];
+			for(j = 0; j < USB_VHCI_PRIO_COUNT; j++)
+			{
+				while(!list_empty(&port->ep_ready_list[j]))
+					list_move_tail(port->ep_ready_list[j].next, &ready);
+				list_del_init(&port->ready_list[j]);
+				port->deficit[j] = 0;
+			}
+		}
+		for(i = 0; i < USB_VHCI_PRIO_COUNT; i++)
+			vhc->prio_skipped[i] = 0;
+		vhc->prio_sched = on;
+		while(!list_empty(&ready))
+		{
+			epq = list_entry(ready.next, struct usb_vhci_ep_queue, ready_list);
+			list_del_init(&epq->ready_list);
+			usb_vhci_inbox_ready(vhc, epq);
+		}
 	}
 	spin_unlock_irqrestore(&vhc->lock, flags);
+	return count;
+}
+
+static DEVICE_ATTR(prio_sched, S_IRUSR | S_IWUSR, show_prio_sched, store_prio_sched);
+
+static ssize_t show_prio_aging(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct usb_vhci_hcd *vhc = pdev_to_vhcihcd(to_platform_device(dev));
+	return sprintf(buf, "%u\n", vhc->prio_aging);
+}
+
+static ssize_t store_prio_aging(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct usb_vhci_hcd *vhc;
+	unsigned long val, flags;
+	char *end;
+
+	vhc = pdev_to_vhcihcd(to_platform_device(dev));
+
+	if(count < 1 || buf == NULL) return -EINVAL;
+	val = simple_strtoul(buf, &end, 10);
+	if(end == buf || val > USB_VHCI_PRIO_AGING_MAX) return -EINVAL;
+	spin_lock_irqsave(&vhc->lock, flags);
+	vhc->prio_aging = val;
+	spin_unlock_irqrestore(&vhc->lock, flags);
+	return count;
+}
+
+static DEVICE_ATTR(prio_aging, S_IRUSR | S_IWUSR, show_prio_aging, store_prio_aging);
+
+static ssize_t show_port_weights(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct usb_vhci_hcd *vhc;
+	size_t size = 0;
+	unsigned long flags;
+	int i;
+
+	vhc = pdev_to_vhcihcd(to_platform_device(dev));
 
+	spin_lock_irqsave(&vhc->lock, flags);
+	for(i = 0; i < vhc->port_count; i++)
+		size += sprintf(buf + size, i ? " %u" : "%u", vhc->ports[i].weight);
+	spin_unlock_irqrestore(&vhc->lock, flags);
+	size += sprintf(buf + size, "\n");
 	return size;
 }
 
+// expects "<port> <weight>" (ports are numbered from 1)
+static ssize_t store_port_weights(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct usb_vhci_hcd *vhc;
+	unsigned long port, weight, flags;
+	char *end;
+
+	vhc = pdev_to_vhcihcd(to_platform_device(dev));
+
+	if(count < 1 || buf == NULL) return -EINVAL;
+	port = simple_strtoul(buf, &end, 10);
+	if(end == buf || port < 1 || port > vhc->port_count) return -EINVAL;
+	buf = end;
+	weight = simple_strtoul(buf, &end, 10);
+	if(end == buf || weight < 1 || weight > USB_VHCI_PORT_WEIGHT_MAX) return -EINVAL;
+	spin_lock_irqsave(&vhc->lock, flags);
+	vhc->ports[port - 1].weight = weight;
+	spin_unlock_irqrestore(&vhc->lock, flags);
+	return count;
+}
+
+static DEVICE_ATTR(port_weights, S_IRUSR | S_IWUSR, show_port_weights, store_port_weights);
+
 static int vhci_start(struct usb_hcd *hcd)
 {
 	struct usb_vhci_hcd *vhc;
 	int retval;
 	struct usb_vhci_port *ports;
+	struct usb_vhci_urb_slot *slots;
 	struct usb_vhci_device *vdev;
 	struct device *dev;
+	u32 i;
 
 	dev = usbhcd_to_dev(hcd);
 
@@ -803,6 +1306,28 @@ static int vhci_start(struct usb_hcd *hcd)
 	ports = kzalloc(vdev->port_count * sizeof(struct usb_vhci_port), GFP_KERNEL);
 	if(unlikely(ports == NULL)) return -ENOMEM;
 
+	slots = kmalloc(USB_VHCI_INITIAL_SLOTS * sizeof *slots, GFP_KERNEL);
+	if(unlikely(slots == NULL))
+	{
+		kfree(ports);
+		return -ENOMEM;
+	}
+	for(i = 0; i < USB_VHCI_INITIAL_SLOTS; i++)
+	{
+		slots[i].urbp = NULL;
+		slots[i].generation = 1;
+		slots[i].next_free = i + 1;
+	}
+	slots[USB_VHCI_INITIAL_SLOTS - 1].next_free = USB_VHCI_NO_SLOT;
+
+	vhc->urbp_pool = mempool_create_slab_pool((vdev->port_count + 1) * USB_VHCI_URBP_POOL_PER_PORT, urbp_cache);
+	if(unlikely(!vhc->urbp_pool))
+	{
+		kfree(slots);
+		kfree(ports);
+		return -ENOMEM;
+	}
+
 	spin_lock_init(&vhc->lock);
 	//init_timer(&vhc->timer);
 	//vhc->timer.function = vhci_timer;
@@ -810,11 +1335,38 @@ static int vhci_start(struct usb_hcd *hcd)
 	vhc->ports = ports;
 	vhc->port_count = vdev->port_count;
 	vhc->port_update = 0;
+	atomic_set(&vhc->work_pending, 0);
+	atomic_set(&vhc->work_edge, 0);
 	atomic_set(&vhc->frame_num, 0);
-	INIT_LIST_HEAD(&vhc->urbp_list_inbox);
+	atomic_set(&vhc->stat_urbs, 0);
+	atomic_set(&vhc->stat_wakeups, 0);
+	atomic_set(&vhc->stat_wakeups_coalesced, 0);
+	atomic_set(&vhc->stat_busy_poll_hits, 0);
+	atomic_set(&vhc->stat_busy_poll_misses, 0);
+	for(i = 0; i < USB_VHCI_PRIO_COUNT; i++)
+	{
+		INIT_LIST_HEAD(&vhc->port_ready_list[i]);
+		vhc->inbox_depth[i] = 0;
+		vhc->prio_skipped[i] = 0;
+	}
+	for(i = 0; i < vhc->port_count; i++)
+	{
+		u32 j;
+		for(j = 0; j < USB_VHCI_PRIO_COUNT; j++)
+		{
+			INIT_LIST_HEAD(&ports[i].ep_ready_list[j]);
+			INIT_LIST_HEAD(&ports[i].ready_list[j]);
+		}
+		ports[i].weight = 1;
+	}
+	vhc->prio_aging = USB_VHCI_PRIO_AGING_DEFAULT;
+	vhc->prio_sched = 0;
 	INIT_LIST_HEAD(&vhc->urbp_list_fetched);
 	INIT_LIST_HEAD(&vhc->urbp_list_cancel);
 	INIT_LIST_HEAD(&vhc->urbp_list_canceling);
+	vhc->slots = slots;
+	vhc->slot_count = USB_VHCI_INITIAL_SLOTS;
+	vhc->slot_free = 0;
 	vhc->rh_state = USB_VHCI_RH_RUNNING;
 
 	hcd->power_budget = 500; // NOTE: practically we have unlimited power because this is a virtual device with... err... virtual power!
@@ -832,9 +1384,54 @@ static int vhci_start(struct usb_hcd *hcd)
 	if(unlikely(retval != 0)) goto rem_file_fetched;
 	retval = device_create_file(dev, &dev_attr_urbs_canceling);
 	if(unlikely(retval != 0)) goto rem_file_cancel;
+	retval = device_create_file(dev, &dev_attr_urbs_enqueued);
+	if(unlikely(retval != 0)) goto rem_file_canceling;
+	retval = device_create_file(dev, &dev_attr_wakeups);
+	if(unlikely(retval != 0)) goto rem_file_enqueued;
+	retval = device_create_file(dev, &dev_attr_wakeups_coalesced);
+	if(unlikely(retval != 0)) goto rem_file_wakeups;
+	retval = device_create_file(dev, &dev_attr_busy_poll_hits);
+	if(unlikely(retval != 0)) goto rem_file_coalesced;
+	retval = device_create_file(dev, &dev_attr_busy_poll_misses);
+	if(unlikely(retval != 0)) goto rem_file_hits;
+	retval = device_create_file(dev, &dev_attr_inbox_depth);
+	if(unlikely(retval != 0)) goto rem_file_misses;
+	retval = device_create_file(dev, &dev_attr_prio_sched);
+	if(unlikely(retval != 0)) goto rem_file_depth;
+	retval = device_create_file(dev, &dev_attr_prio_aging);
+	if(unlikely(retval != 0)) goto rem_file_sched;
+	retval = device_create_file(dev, &dev_attr_port_weights);
+	if(unlikely(retval != 0)) goto rem_file_aging;
 
 	return 0;
 
+rem_file_aging:
+	device_remove_file(dev, &dev_attr_prio_aging);
+
+rem_file_sched:
+	device_remove_file(dev, &dev_attr_prio_sched);
+
+rem_file_depth:
+	device_remove_file(dev, &dev_attr_inbox_depth);
+
+rem_file_misses:
+	device_remove_file(dev, &dev_attr_busy_poll_misses);
+
+rem_file_hits:
+	device_remove_file(dev, &dev_attr_busy_poll_hits);
+
+rem_file_coalesced:
+	device_remove_file(dev, &dev_attr_wakeups_coalesced);
+
+rem_file_wakeups:
+	device_remove_file(dev, &dev_attr_wakeups);
+
+rem_file_enqueued:
+	device_remove_file(dev, &dev_attr_urbs_enqueued);
+
+rem_file_canceling:
+	device_remove_file(dev, &dev_attr_urbs_canceling);
+
 rem_file_cancel:
 	device_remove_file(dev, &dev_attr_urbs_cancel);
 
@@ -845,6 +1442,11 @@ rem_file_inbox:
 	device_remove_file(dev, &dev_attr_urbs_inbox);
 
 kfree_port_arr:
+	mempool_destroy(vhc->urbp_pool);
+	vhc->urbp_pool = NULL;
+	kfree(slots);
+	vhc->slots = NULL;
+	vhc->slot_count = 0;
 	kfree(ports);
 	vhc->ports = NULL;
 	vhc->port_count = 0;
@@ -862,6 +1464,15 @@ static void vhci_stop(struct usb_hcd *hcd)
 
 	vhc = usbhcd_to_vhcihcd(hcd);
 
+	device_remove_file(dev, &dev_attr_port_weights);
+	device_remove_file(dev, &dev_attr_prio_aging);
+	device_remove_file(dev, &dev_attr_prio_sched);
+	device_remove_file(dev, &dev_attr_inbox_depth);
+	device_remove_file(dev, &dev_attr_busy_poll_misses);
+	device_remove_file(dev, &dev_attr_busy_poll_hits);
+	device_remove_file(dev, &dev_attr_wakeups_coalesced);
+	device_remove_file(dev, &dev_attr_wakeups);
+	device_remove_file(dev, &dev_attr_urbs_enqueued);
 	device_remove_file(dev, &dev_attr_urbs_canceling);
 	device_remove_file(dev, &dev_attr_urbs_cancel);
 	device_remove_file(dev, &dev_attr_urbs_fetched);
@@ -874,6 +1485,16 @@ static void vhci_stop(struct usb_hcd *hcd)
 		vhc->port_count = 0;
 	}
 
+	kfree(vhc->slots);
+	vhc->slots = NULL;
+	vhc->slot_count = 0;
+
+	if(likely(vhc->urbp_pool))
+	{
+		mempool_destroy(vhc->urbp_pool);
+		vhc->urbp_pool = NULL;
+	}
+
 	vhc->rh_state = USB_VHCI_RH_RESET;
 	dev_info(dev, "stopped\n");
 }
@@ -898,6 +1519,7 @@ static const struct hc_driver vhci_hcd = {
 
 	.urb_enqueue      = vhci_urb_enqueue,
 	.urb_dequeue      = vhci_urb_dequeue,
+	.endpoint_disable = vhci_endpoint_disable,
 
 	.get_frame_number = vhci_get_frame,
 
@@ -946,9 +1568,8 @@ static int vhci_hcd_remove(struct platform_device *pdev)
 	trace_function(vhcihcd_to_dev(vhc));
 
 	spin_lock_irqsave(&vhc->lock, flags);
-	while(!list_empty(&vhc->urbp_list_inbox))
+	while((urbp = usb_vhci_inbox_next(vhc)))
 	{
-		urbp = list_entry(vhc->urbp_list_inbox.next, struct usb_vhci_urb_priv, urbp_list);
 		usb_vhci_maybe_set_status(urbp, -ESHUTDOWN);
 		usb_vhci_urb_giveback(vhc, urbp);
 	}
@@ -1155,17 +1776,10 @@ int usb_vhci_hcd_unregister(struct usb_vhci_device *vdev)
 }
 EXPORT_SYMBOL_GPL(usb_vhci_hcd_unregister);
 
+// does not need vhc->lock, so it is cheap enough for wait_event conditions
 int usb_vhci_hcd_has_work(struct usb_vhci_hcd *vhc)
 {
-	unsigned long flags;
-	int y = 0;
-	spin_lock_irqsave(&vhc->lock, flags);
-	if(vhc->port_update ||
-	   !list_empty(&vhc->urbp_list_cancel) ||
-	   !list_empty(&vhc->urbp_list_inbox))
-		y = 1;
-	spin_unlock_irqrestore(&vhc->lock, flags);
-	return y;
+	return atomic_read(&vhc->work_pending) != 0;
 }
 EXPORT_SYMBOL_GPL(usb_vhci_hcd_has_work);
 
@@ -1320,6 +1934,17 @@ static int __init init(void)
 
 	vhci_printk(KERN_INFO, DRIVER_DESC " -- Version " DRIVER_VERSION "\n");
 
+#ifdef OLD_KMEM_CACHE_CREATE
+	urbp_cache = kmem_cache_create("usb_vhci_urb_priv", sizeof(struct usb_vhci_urb_priv), 0, SLAB_HWCACHE_ALIGN, NULL, NULL);
+#else
+	urbp_cache = kmem_cache_create("usb_vhci_urb_priv", sizeof(struct usb_vhci_urb_priv), 0, SLAB_HWCACHE_ALIGN, NULL);
+#endif
+	if(unlikely(!urbp_cache))
+	{
+		vhci_printk(KERN_ERR, "create slab cache failed\n");
+		return -ENOMEM;
+	}
+
 #ifdef DEBUG
 	vhci_printk(KERN_DEBUG, "register platform_driver %s\n", driver_name);
 #endif
@@ -1327,6 +1952,7 @@ static int __init init(void)
 	if(unlikely(retval < 0))
 	{
 		vhci_printk(KERN_ERR, "register platform_driver failed\n");
+		kmem_cache_destroy(urbp_cache);
 		return retval;
 	}
 
@@ -1350,6 +1976,7 @@ static void __exit cleanup(void)
 #endif
 	vhci_dbg("unregister platform_driver %s\n", driver_name);
 	platform_driver_unregister(&vhci_hcd_driver);
+	kmem_cache_destroy(urbp_cache);
 	vhci_dbg("gone\n");
 }
 module_exit(cleanup);
@@ -30,6 +30,7 @@
 #include <linux/platform_device.h>
 #include <linux/usb.h>
 #include <linux/device.h>
+#include <linux/mempool.h>
 
 #include <asm/atomic.h>
 
@@ -52,11 +53,37 @@
 #	include "usb-vhci.config.h"
 #endif
 
+// priority classes of the inbox (see usb_vhci_inbox_next)
+enum usb_vhci_prio
+{
+	USB_VHCI_PRIO_PERIODIC = 0, // isochronous and interrupt endpoints
+	USB_VHCI_PRIO_CONTROL  = 1,
+	USB_VHCI_PRIO_BULK     = 2,
+	USB_VHCI_PRIO_COUNT    = 3
+};
+
+// a waiting class is served once after it has been passed over this many times (0 = never)
+#define USB_VHCI_PRIO_AGING_DEFAULT 8
+#define USB_VHCI_PRIO_AGING_MAX     10000
+
+// within a class, the ports are served by deficit round-robin: per round, a port may send
+// weight * USB_VHCI_DRR_QUANTUM bytes, and each urb costs USB_VHCI_DRR_URB_COST on top of its
+// transfer buffer
+#define USB_VHCI_DRR_QUANTUM     4096
+#define USB_VHCI_DRR_URB_COST    64
+#define USB_VHCI_PORT_WEIGHT_MAX 64
+
 struct usb_vhci_port
 {
 	u16 port_status;
 	u16 port_change;
 	u8 port_flags;
+
+	// endpoints of the devices behind this port which have urbs in the inbox (per class)
+	struct list_head ep_ready_list[USB_VHCI_PRIO_COUNT];
+	struct list_head ready_list[USB_VHCI_PRIO_COUNT]; // entry in vhc->port_ready_list
+	unsigned int deficit[USB_VHCI_PRIO_COUNT];        // bytes the port may still send this round
+	unsigned int weight;                              // 1..USB_VHCI_PORT_WEIGHT_MAX
 };
 
 enum usb_vhci_rh_state
@@ -92,18 +119,60 @@ struct usb_vhci_device
 	unsigned long ifc_priv[0] __attribute__((aligned(sizeof(unsigned long))));
 };
 
+enum usb_vhci_urb_state
+{
+	USB_VHCI_URB_STATE_INBOX     = 0, // waiting to get fetched by user space
+	USB_VHCI_URB_STATE_FETCHED   = 1, // fetched by user space
+	USB_VHCI_URB_STATE_CANCEL    = 2, // fetched and should be canceled
+	USB_VHCI_URB_STATE_CANCELING = 3, // fetched and user space knows about the cancelation
+	USB_VHCI_URB_STATE_GIVEBACK  = 4  // taken off all lists; about to be given back
+} __attribute__((packed));
+
+struct usb_vhci_ep_queue;
+
 struct usb_vhci_urb_priv
 {
 	struct urb *urb;
 	struct list_head urbp_list;
+	struct usb_vhci_ep_queue *epq; // inbox of the endpoint of this urb
 	atomic_t status;
+	u64 handle; // opaque handle for user space (generation << 32 | slot index)
+	enum usb_vhci_urb_state state;
+	u8 giveback_on_unpin; // used by the ifc: give back the urb when pin_count drops to zero
+	u16 pin_count;        // used by the ifc: number of threads which access the urb without holding the lock
+	u8 data_mapped;       // used by the ifc: the transfer buffer is mapped into user space
+	u8 map_index;         // used by the ifc: index of the mapping (if data_mapped is set)
+};
+
+// inbox of an endpoint (hung off usb_host_endpoint->hcpriv)
+struct usb_vhci_ep_queue
+{
+	struct list_head urbp_list;  // urbs of this endpoint which are waiting to get fetched (in order)
+	struct list_head ready_list; // entry in ports[port].ep_ready_list while urbp_list isn't empty
+	u8 prio;                     // class of the endpoint (enum usb_vhci_prio)
+	u8 port;                     // index of the root hub port the device is behind
 };
 
+// entry of the handle table, which maps handles to urbs
+struct usb_vhci_urb_slot
+{
+	struct usb_vhci_urb_priv *urbp; // NULL if the slot is unused
+	u32 generation;                 // incremented whenever the slot gets freed
+	u32 next_free;                  // next entry of the free-list
+};
+
+#define USB_VHCI_NO_SLOT 0xffffffff
+
 struct usb_vhci_hcd
 {
 	struct usb_vhci_port *ports;
 	u32 port_update;
 
+	// summary of port_update, urbp_list_cancel and ep_ready_list (USB_VHCI_PENDING_*); it is
+	// only written with lock held, but may be read without it
+	atomic_t work_pending;
+	atomic_t work_edge; // set when work_pending becomes nonzero; cleared by the ifc
+
 	spinlock_t lock;
 
 	atomic_t frame_num;
@@ -112,8 +181,17 @@ struct usb_vhci_hcd
 	// TODO: implement timer for incrementing frame_num every millisecond
 	//struct timer_list timer;
 
-	// urbs which are waiting to get fetched by user space are in this list
-	struct list_head urbp_list_inbox;
+	// urbs which are waiting to get fetched by user space are queued per endpoint. The endpoints
+	// which have urbs queued are in the ep_ready_list of their port and are served round-robin,
+	// so that a busy endpoint can't delay the others. The ports which have such endpoints are in
+	// these lists (struct usb_vhci_port) and are served by deficit round-robin, so that a busy
+	// device can't delay the devices on the other ports. Without prio_sched everything is in the
+	// lists of class 0, with it each endpoint is in the lists of its class.
+	struct list_head port_ready_list[USB_VHCI_PRIO_COUNT];
+	unsigned int inbox_depth[USB_VHCI_PRIO_COUNT];  // number of urbs in the inbox per class
+	unsigned int prio_skipped[USB_VHCI_PRIO_COUNT]; // how often the class has been passed over
+	unsigned int prio_aging;
+	u8 prio_sched;
 
 	// urbs which were fetched by user space but not already given back are in this list
 	struct list_head urbp_list_fetched;
@@ -126,9 +204,61 @@ struct usb_vhci_hcd
 	// user space already knows about the cancelation state are in this list
 	struct list_head urbp_list_canceling;
 
+	// handle table; an urb gets its slot on enqueue and loses it on giveback
+	struct usb_vhci_urb_slot *slots;
+	u32 slot_count;
+	u32 slot_free; // head of the free-list (USB_VHCI_NO_SLOT if the table is full)
+
+	// reserve of urbp's for this controller (backed by the usb_vhci_urb_priv slab cache)
+	mempool_t *urbp_pool;
+
+	// statistics; stat_urbs counts enqueued urbs, the wakeup counters are updated by the ifc
+	atomic_t stat_urbs;
+	atomic_t stat_wakeups;
+	atomic_t stat_wakeups_coalesced;
+	atomic_t stat_busy_poll_hits;
+	atomic_t stat_busy_poll_misses;
+
 	u8 port_count;
 };
 
+// bits of vhc->work_pending
+#define USB_VHCI_PENDING_PORT_UPDATE 0x01
+#define USB_VHCI_PENDING_CANCEL      0x02
+#define USB_VHCI_PENDING_INBOX       0x04
+
+// caller has vhc->lock
+static inline int usb_vhci_inbox_empty(struct usb_vhci_hcd *vhc)
+{
+	int i;
+	for(i = 0; i < USB_VHCI_PRIO_COUNT; i++)
+		if(!list_empty(&vhc->port_ready_list[i]))
+			return 0;
+	return 1;
+}
+
+// has to be called whenever port_update, urbp_list_cancel or ep_ready_list has been changed
+// caller has vhc->lock
+static inline void usb_vhci_update_work_pending(struct usb_vhci_hcd *vhc)
+{
+	int pending = 0;
+	if(vhc->port_update)
+		pending |= USB_VHCI_PENDING_PORT_UPDATE;
+	if(!list_empty(&vhc->urbp_list_cancel))
+		pending |= USB_VHCI_PENDING_CANCEL;
+	if(!usb_vhci_inbox_empty(vhc))
+		pending |= USB_VHCI_PENDING_INBOX;
+	if(pending && !atomic_read(&vhc->work_pending))
+		atomic_set(&vhc->work_edge, 1);
+	atomic_set(&vhc->work_pending, pending);
+}
+
+// caller has vhc->lock
+static inline int usb_vhci_hcd_has_work_locked(struct usb_vhci_hcd *vhc)
+{
+	return atomic_read(&vhc->work_pending) != 0;
+}
+
 static inline struct usb_vhci_device *pdev_to_vhcidev(struct platform_device *pdev)
 {
 	return pdev->dev.platform_data;
@@ -204,11 +334,92 @@ static inline struct usb_hcd *pdev_to_usbhcd(struct platform_device *pdev)
 	return vhcidev_to_usbhcd(pdev_to_vhcidev(pdev));
 }
 
+// caller has vhc->lock
+static inline struct list_head *usb_vhci_urb_state_list(struct usb_vhci_hcd *vhc, enum usb_vhci_urb_state state)
+{
+	switch(state)
+	{
+	case USB_VHCI_URB_STATE_FETCHED:   return &vhc->urbp_list_fetched;
+	case USB_VHCI_URB_STATE_CANCEL:    return &vhc->urbp_list_cancel;
+	case USB_VHCI_URB_STATE_CANCELING: return &vhc->urbp_list_canceling;
+	default:                           return NULL;
+	}
+}
+
+// puts the endpoint (which has urbs in its inbox) into the ready lists
+// caller has vhc->lock
+static inline void usb_vhci_inbox_ready(struct usb_vhci_hcd *vhc, struct usb_vhci_ep_queue *epq)
+{
+	struct usb_vhci_port *const port = &vhc->ports[epq->port];
+	const int prio = vhc->prio_sched ? epq->prio : 0;
+	// (the deficit of the port is zero here; it gets its quanta in usb_vhci_inbox_next only)
+	if(list_empty(&port->ep_ready_list[prio]))
+		list_add_tail(&port->ready_list[prio], &vhc->port_ready_list[prio]);
+	list_add_tail(&epq->ready_list, &port->ep_ready_list[prio]);
+}
+
+// takes the endpoint out of the ready lists
+// caller has vhc->lock
+static inline void usb_vhci_inbox_unready(struct usb_vhci_hcd *vhc, struct usb_vhci_ep_queue *epq)
+{
+	struct usb_vhci_port *const port = &vhc->ports[epq->port];
+	const int prio = vhc->prio_sched ? epq->prio : 0;
+	list_del_init(&epq->ready_list);
+	if(list_empty(&port->ep_ready_list[prio]))
+	{
+		list_del_init(&port->ready_list[prio]);
+		port->deficit[prio] = 0;
+	}
+}
+
+// puts the urb at the end of the inbox of its endpoint
+// caller has vhc->lock
+static inline void usb_vhci_inbox_add(struct usb_vhci_hcd *vhc, struct usb_vhci_urb_priv *urbp)
+{
+	struct usb_vhci_ep_queue *epq = urbp->epq;
+	if(list_empty(&epq->urbp_list))
+		usb_vhci_inbox_ready(vhc, epq);
+	list_add_tail(&urbp->urbp_list, &epq->urbp_list);
+	vhc->inbox_depth[epq->prio]++;
+	urbp->state = USB_VHCI_URB_STATE_INBOX;
+}
+
+// takes the urb out of the inbox of its endpoint
+// caller has vhc->lock
+static inline void usb_vhci_inbox_del(struct usb_vhci_hcd *vhc, struct usb_vhci_urb_priv *urbp)
+{
+	struct usb_vhci_ep_queue *epq = urbp->epq;
+	list_del_init(&urbp->urbp_list);
+	vhc->inbox_depth[epq->prio]--;
+	if(list_empty(&epq->urbp_list))
+		usb_vhci_inbox_unready(vhc, epq);
+}
+
+// moves the urb to the tail of the list which belongs to the new state
+// (USB_VHCI_URB_STATE_GIVEBACK just takes it off its current list; use usb_vhci_inbox_add for
+// USB_VHCI_URB_STATE_INBOX)
+// caller has vhc->lock
+static inline void usb_vhci_urb_set_state(struct usb_vhci_hcd *vhc, struct usb_vhci_urb_priv *urbp, enum usb_vhci_urb_state state)
+{
+	struct list_head *list = usb_vhci_urb_state_list(vhc, state);
+	if(urbp->state == USB_VHCI_URB_STATE_INBOX)
+		usb_vhci_inbox_del(vhc, urbp);
+	if(list)
+		list_move_tail(&urbp->urbp_list, list);
+	else
+		list_del_init(&urbp->urbp_list);
+	urbp->state = state;
+	usb_vhci_update_work_pending(vhc);
+}
+
 const char *usb_vhci_dev_name(struct usb_vhci_device *vdev);
 int usb_vhci_dev_id(struct usb_vhci_device *vdev);
 int usb_vhci_dev_busnum(struct usb_vhci_device *vdev);
 void usb_vhci_maybe_set_status(struct usb_vhci_urb_priv *urbp, int status);
 void usb_vhci_urb_giveback(struct usb_vhci_hcd *vhc, struct usb_vhci_urb_priv *urbp);
+void usb_vhci_urb_giveback_list(struct usb_vhci_hcd *vhc, struct list_head *list);
+struct usb_vhci_urb_priv *usb_vhci_inbox_next(struct usb_vhci_hcd *vhc);
+struct usb_vhci_urb_priv *usb_vhci_urbp_from_handle(struct usb_vhci_hcd *vhc, u64 handle);
 int usb_vhci_hcd_register(const struct usb_vhci_ifc *ifc, void *context, u8 port_count, struct usb_vhci_device **vdev_ret);
 int usb_vhci_hcd_unregister(struct usb_vhci_device *vdev);
 int usb_vhci_hcd_has_work(struct usb_vhci_hcd *vhc);
@@ -34,12 +34,32 @@
 #include <linux/platform_device.h>
 #include <linux/usb.h>
 #include <linux/fs.h>
+#include <linux/poll.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/interrupt.h>
+#include <linux/cache.h>
+#include <linux/rwsem.h>
+#include <linux/highmem.h>
+#include <linux/file.h>
+#include <linux/uio.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#ifndef NO_EVENTFD_CTX
+#	include <linux/eventfd.h>
+#endif
+#ifndef NO_USE_MM
+#	include <linux/aio.h>
+#	include <linux/workqueue.h>
+#	include <linux/mmu_context.h>
+#endif
 
 #include "usb-vhci-hcd.h"
 
 #include <asm/atomic.h>
 #include <asm/bitops.h>
 #include <asm/uaccess.h>
+#include <asm/io.h>
 
 #define DRIVER_NAME "usb_vhci_iocifc"
 #define DRIVER_DESC "User-mode IOCTL-interface for USB VHCI"
@@ -77,15 +97,105 @@ static const char driver_desc[] = DRIVER_DESC;
 static unsigned int debug_output = 0;
 #endif
 
+// wakeup coalescing (see trigger_work_event)
+static unsigned int wakeup_coalescing = 0; // skip the wakeup while a consumer is draining
+static unsigned int wakeup_delay_us = 0;   // gather work for this long before waking up (0 = off)
+#define VHCI_WAKEUP_DELAY_MAX 1000
+
+#ifdef OLD_HRTIMER_MODE
+#	define HRTIMER_MODE_REL HRTIMER_REL
+#	define HRTIMER_MODE_ABS HRTIMER_ABS
+typedef int vhci_hrtimer_ret_t;
+#else
+typedef enum hrtimer_restart vhci_hrtimer_ret_t;
+#endif
+
+#ifdef NO_HRTIMER_ON_STACK
+#	define hrtimer_init_on_stack hrtimer_init
+#	define destroy_hrtimer_on_stack(timer) do {} while(0)
+#endif
+
 MODULE_DESCRIPTION(DRIVER_DESC " driver");
 MODULE_AUTHOR("Michael Singer <michael@a-singer.de>");
 MODULE_LICENSE("GPL");
 
+struct vhci_rings;
+
+// unused buffer in the bounce buffer pool
+struct vhci_bounce
+{
+	struct vhci_bounce *next;
+};
+
+// user buffer which was registered by USB_VHCI_HCD_IOCREGISTER_BUFFERS
+struct vhci_fixed_buffer
+{
+	unsigned long address;
+	u32 length;
+	unsigned int page_count;
+	struct page **pages;    // pinned pages
+};
+
+#ifndef NO_ZAP_VMA_PTES
+#define VHCI_DATA_PGOFF        (USB_VHCI_MMAP_DATA_OFFSET >> PAGE_SHIFT)
+#define VHCI_DATA_WINDOW_PAGES (USB_VHCI_DATA_WINDOW_MAX >> PAGE_SHIFT)
+
+// an urb whose transfer buffer is mapped into the data window
+struct vhci_data_map
+{
+	u64 handle;          // zero if the entry is unused
+	unsigned long first; // first page inside the window
+	unsigned long pages;
+};
+
+// state of the data window (see USB_VHCI_HCD_IOCMAPDATA)
+struct vhci_data_window
+{
+	spinlock_t lock;                 // protects mm
+	struct mutex mutex;              // protects the rest, if not stated otherwise (taken after mm->mmap_sem)
+	struct mm_struct *mm;            // address space the window is mapped into (we hold a reference on mm_count)
+	struct vm_area_struct *vma;      // the vma, if the window is mapped by a single vma we know about
+	unsigned int vma_count;          // number of vmas which map the window
+	unsigned long used[BITS_TO_LONGS(VHCI_DATA_WINDOW_PAGES)]; // allocated pages
+	struct vhci_data_map map[USB_VHCI_DATA_MAX_MAPS];
+	unsigned long revoke[BITS_TO_LONGS(USB_VHCI_DATA_MAX_MAPS)]; // maps to remove (protected by vhc->lock)
+	struct list_head revoke_list;    // urbs which are given back after their data was unmapped (protected by vhc->lock)
+	u8 revoke_pending;               // set if run_revokes has something to do (protected by vhc->lock)
+};
+#endif
+
 struct vhci_ifc_priv
 {
 	struct file *file;
 	wait_queue_head_t work_event;
+	spinlock_t ring_lock; // protects the rings pointer against trigger_work_event
+	struct vhci_rings *rings;
+#ifndef NO_EVENTFD_CTX
+	struct eventfd_ctx *eventfd;     // signaled when work becomes pending (protected by ring_lock)
+#endif
+#ifndef NO_USE_MM
+	spinlock_t aio_lock;             // protects aio_list
+	struct list_head aio_list;       // pending aio reads (struct vhci_aio_read)
+	struct work_struct aio_work;     // completes them (aio_work_fn)
+#endif
+	spinlock_t bounce_lock;
+	struct vhci_bounce *bounce_free; // unused bounce buffers
+	unsigned int bounce_count;       // number of buffers in bounce_free
+	struct rw_semaphore fixed_sem;   // protects fixed and fixed_count
+	struct vhci_fixed_buffer *fixed; // registered buffers
+	unsigned int fixed_count;
 	u8 port_sched_offset;
+	atomic_t draining;               // number of consumers which are about to take work
+	atomic_t write_err;              // error of a giveback record, reported by the next write
+	unsigned int busy_poll_us;       // busy-poll budget of the fetch ioctls (0 = off)
+	ktime_t last_arrival;            // time of the last event (protected by ring_lock)
+	unsigned long arrival_avg_ns;    // moving average of the time between two events
+	                                 // (written with ring_lock held)
+	atomic_t wakeup_armed;           // wakeup_timer is pending
+	struct hrtimer wakeup_timer;     // delivers the delayed wakeup (see wakeup_delay_us)
+#ifndef NO_ZAP_VMA_PTES
+	struct vhci_data_window window;
+#endif
 
 #ifdef DEBUG
 	u16 debug_magic;
@@ -117,6 +227,21 @@ static inline struct vhci_ifc_priv *file_to_ifcp(struct file *file)
 	return vhcidev_to_ifcp(file_to_vhcidev(file));
 }
 
+#ifndef NO_USE_MM
+static void aio_work_fn(struct work_struct *work);
+#endif
+
+static vhci_hrtimer_ret_t wakeup_timer_fn(struct hrtimer *timer)
+{
+	struct vhci_ifc_priv *ifcp = container_of(timer, struct vhci_ifc_priv, wakeup_timer);
+
+	// clear the flag first, so that work which is queued from now on arms the timer again
+	atomic_set(&ifcp->wakeup_armed, 0);
+	smp_mb();
+	wake_up_interruptible(&ifcp->work_event);
+	return HRTIMER_NORESTART;
+}
+
 static int init_ifc_priv(void *context, void *ifc_priv)
 {
 	struct vhci_ifc_priv *ifcp;
@@ -130,7 +255,37 @@ static int init_ifc_priv(void *context, void *ifc_priv)
 
 	ifcp->file = context;
 	init_waitqueue_head(&ifcp->work_event);
+	spin_lock_init(&ifcp->ring_lock);
+	ifcp->rings = NULL;
+#ifndef NO_EVENTFD_CTX
+	ifcp->eventfd = NULL;
+#endif
+#ifndef NO_USE_MM
+	spin_lock_init(&ifcp->aio_lock);
+	INIT_LIST_HEAD(&ifcp->aio_list);
+	INIT_WORK(&ifcp->aio_work, aio_work_fn);
+#endif
+	spin_lock_init(&ifcp->bounce_lock);
+	ifcp->bounce_free = NULL;
+	ifcp->bounce_count = 0;
+	init_rwsem(&ifcp->fixed_sem);
+	ifcp->fixed = NULL;
+	ifcp->fixed_count = 0;
 	ifcp->port_sched_offset = 0;
+	atomic_set(&ifcp->draining, 0);
+	atomic_set(&ifcp->write_err, 0);
+	ifcp->busy_poll_us = 0;
+	ifcp->last_arrival = ktime_set(0, 0);
+	ifcp->arrival_avg_ns = 0;
+	atomic_set(&ifcp->wakeup_armed, 0);
+	hrtimer_init(&ifcp->wakeup_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	ifcp->wakeup_timer.function = wakeup_timer_fn;
+#ifndef NO_ZAP_VMA_PTES
+	memset(&ifcp->window, 0, sizeof ifcp->window);
+	spin_lock_init(&ifcp->window.lock);
+	mutex_init(&ifcp->window.mutex);
+	INIT_LIST_HEAD(&ifcp->window.revoke_list);
+#endif
 
 #ifdef DEBUG
 	ifcp->debug_magic = 0x55aa;
@@ -139,23 +294,221 @@ static int init_ifc_priv(void *context, void *ifc_priv)
 	return 0;
 }
 
-#ifdef DEBUG
 static void destroy_ifc_priv(void *ifc_priv)
 {
 	struct vhci_ifc_priv *ifcp = ifc_priv;
 
+#ifdef DEBUG
 	if(ifcp->debug_magic == 0xaa55)
 		vhci_printk(KERN_WARNING, "destroy_ifc_priv called twice\n");
 	else if(ifcp->debug_magic != 0x55aa)
 		vhci_printk(KERN_WARNING, "destroy_ifc_priv called, but ifc_priv was not initialized\n");
+#endif
 
+	// the hcd is gone already, so nobody can arm the timer again
+	hrtimer_cancel(&ifcp->wakeup_timer);
+
+#ifdef DEBUG
 	ifcp->debug_magic = 0xaa55;
+#endif
 }
+
+static void ring_schedule(struct vhci_rings *rings);
+static void free_rings(struct vhci_ifc_priv *ifcp);
+#ifndef NO_EVENTFD_CTX
+static void set_eventfd(struct vhci_ifc_priv *ifcp, struct eventfd_ctx *ctx);
+#endif
+static void release_fixed_buffers(struct vhci_fixed_buffer *fixed, unsigned int count);
+#ifndef NO_ZAP_VMA_PTES
+static void run_revokes(struct vhci_ifc_priv *ifcp, struct usb_vhci_hcd *vhc);
+#else
+static inline void run_revokes(struct vhci_ifc_priv *ifcp, struct usb_vhci_hcd *vhc) {}
 #endif
 
+// A consumer is draining from drain_begin (before it takes vhc->lock to fetch work) until
+// drain_end (before it releases vhc->lock again). New work is added under vhc->lock too, so if
+// trigger_work_event sees a draining consumer, that consumer is going to see the new work, and
+// the wakeup can be skipped if wakeup_coalescing is enabled.
+static inline void drain_begin(struct vhci_ifc_priv *ifcp)
+{
+	atomic_inc(&ifcp->draining);
+	smp_mb__after_atomic_inc();
+}
+
+// Returns nonzero if there is work left, which the caller has to pass on to the next waiter by
+// calling pass_on_work after releasing vhc->lock.
+// caller has vhc->lock
+static inline int drain_end(struct vhci_ifc_priv *ifcp, struct usb_vhci_hcd *vhc)
+{
+	smp_mb__before_atomic_dec();
+	atomic_dec(&ifcp->draining);
+	return usb_vhci_hcd_has_work_locked(vhc);
+}
+
+// Consumers wait exclusively on work_event, so every wakeup reaches only one of them. A consumer
+// which leaves work behind wakes the next one, so that the work is spread over all waiting
+// threads instead of waking all of them for every urb.
+static inline void pass_on_work(struct vhci_ifc_priv *ifcp)
+{
+	wake_up_interruptible(&ifcp->work_event);
+}
+
+// the average inter-arrival time is capped, so that a long idle period only disables busy-polling
+// for a few events
+#define VHCI_ARRIVAL_AVG_MAX_NS (NSEC_PER_SEC / 10)
+
+// Updates the moving average of the time between two events (weight of the new sample: 1/8).
+// caller has ifcp->ring_lock
+static inline void note_arrival(struct vhci_ifc_priv *ifcp)
+{
+	ktime_t now = ktime_get();
+	s64 delta = ktime_to_ns(ktime_sub(now, ifcp->last_arrival));
+	long avg = ifcp->arrival_avg_ns;
+
+	ifcp->last_arrival = now;
+	if(delta > VHCI_ARRIVAL_AVG_MAX_NS)
+		delta = VHCI_ARRIVAL_AVG_MAX_NS;
+	avg += ((long)delta - avg) / 8;
+	ifcp->arrival_avg_ns = avg;
+}
+
 static void trigger_work_event(struct usb_vhci_device *vdev)
 {
-	wake_up_interruptible(&vhcidev_to_ifcp(vdev)->work_event);
+	struct vhci_ifc_priv *ifcp = vhcidev_to_ifcp(vdev);
+	struct usb_vhci_hcd *vhc = vhcidev_to_vhcihcd(vdev);
+	unsigned long flags;
+	unsigned int delay;
+
+	spin_lock_irqsave(&ifcp->ring_lock, flags);
+	if(ifcp->rings)
+		ring_schedule(ifcp->rings);
+	if(ifcp->busy_poll_us)
+		note_arrival(ifcp);
+#ifndef NO_EVENTFD_CTX
+	if(atomic_xchg(&vhc->work_edge, 0) && ifcp->eventfd)
+		eventfd_signal(ifcp->eventfd, 1);
+#endif
+	spin_unlock_irqrestore(&ifcp->ring_lock, flags);
+#ifndef NO_USE_MM
+	// Only a hint, so aio_lock isn't taken here: if we miss a read which is just being queued,
+	// device_aio_read sees the work by itself, because it checks for work after queueing. A
+	// spurious schedule finds an empty list.
+	if(!list_empty_careful(&ifcp->aio_list))
+		schedule_work(&ifcp->aio_work);
+#endif
+
+	if(wakeup_coalescing)
+	{
+		smp_mb();
+		if(atomic_read(&ifcp->draining))
+			goto coalesced;
+	}
+
+	delay = wakeup_delay_us;
+	if(delay)
+	{
+		// the first piece of work arms the timer, everything else up to its expiry rides along
+		if(atomic_xchg(&ifcp->wakeup_armed, 1))
+			goto coalesced;
+		hrtimer_start(&ifcp->wakeup_timer, ktime_set(0, delay * NSEC_PER_USEC), HRTIMER_MODE_REL);
+	}
+	else
+		wake_up_interruptible(&ifcp->work_event);
+	atomic_inc(&vhc->stat_wakeups);
+	return;
+
+coalesced:
+	atomic_inc(&vhc->stat_wakeups_coalesced);
+}
+
+// size of the buffers in the bounce buffer pool and maximum number of unused buffers in the pool
+#define VHCI_BOUNCE_SIZE      USB_VHCI_RECORD_BUFFER_MAX
+#define VHCI_BOUNCE_POOL_SIZE 4
+
+// Returns a buffer of at least size bytes. Buffers up to VHCI_BOUNCE_SIZE bytes are taken from the
+// per-file pool, so that the batched ioctls and read/write don't need to allocate memory for every
+// call.
+static void *get_bounce(struct vhci_ifc_priv *ifcp, size_t size)
+{
+	struct vhci_bounce *b;
+	unsigned long flags;
+
+	if(unlikely(size > VHCI_BOUNCE_SIZE))
+		return kmalloc(size, GFP_KERNEL);
+	spin_lock_irqsave(&ifcp->bounce_lock, flags);
+	b = ifcp->bounce_free;
+	if(likely(b))
+	{
+		ifcp->bounce_free = b->next;
+		ifcp->bounce_count--;
+	}
+	spin_unlock_irqrestore(&ifcp->bounce_lock, flags);
+	if(unlikely(!b))
+		b = kmalloc(VHCI_BOUNCE_SIZE, GFP_KERNEL);
+	return b;
+}
+
+// Returns a buffer which was allocated by get_bounce.
+static void put_bounce(struct vhci_ifc_priv *ifcp, void *buf, size_t size)
+{
+	struct vhci_bounce *b = buf;
+	unsigned long flags;
+
+	if(unlikely(!b))
+		return;
+	if(likely(size <= VHCI_BOUNCE_SIZE))
+	{
+		spin_lock_irqsave(&ifcp->bounce_lock, flags);
+		if(likely(ifcp->bounce_count < VHCI_BOUNCE_POOL_SIZE))
+		{
+			b->next = ifcp->bounce_free;
+			ifcp->bounce_free = b;
+			ifcp->bounce_count++;
+			b = NULL;
+		}
+		spin_unlock_irqrestore(&ifcp->bounce_lock, flags);
+	}
+	kfree(b);
+}
+
+// called in device_release only
+static void free_bounce_pool(struct vhci_ifc_priv *ifcp)
+{
+	struct vhci_bounce *b;
+	while((b = ifcp->bounce_free))
+	{
+		ifcp->bounce_free = b->next;
+		kfree(b);
+	}
+	ifcp->bounce_count = 0;
+}
+
+// Marks the data mapping of the urb for removal; run_revokes does the actual work.
+// caller has vhc->lock
+static inline void revoke_locked(struct vhci_ifc_priv *ifcp, struct usb_vhci_urb_priv *urbp)
+{
+#ifndef NO_ZAP_VMA_PTES
+	__set_bit(urbp->map_index, ifcp->window.revoke);
+	ifcp->window.revoke_pending = 1;
+#endif
+}
+
+// Gives back the urb to its creator. If its transfer buffer is still mapped into user space, the
+// giveback is deferred until run_revokes has removed the mapping.
+// caller has vhc->lock
+static void ifc_giveback(struct usb_vhci_hcd *vhc, struct usb_vhci_urb_priv *urbp)
+{
+#ifndef NO_ZAP_VMA_PTES
+	if(unlikely(urbp->data_mapped))
+	{
+		struct vhci_ifc_priv *ifcp = vhcihcd_to_ifcp(vhc);
+		usb_vhci_urb_set_state(vhc, urbp, USB_VHCI_URB_STATE_GIVEBACK);
+		list_add_tail(&urbp->urbp_list, &ifcp->window.revoke_list);
+		revoke_locked(ifcp, urbp);
+		return;
+	}
+#endif
+	usb_vhci_urb_giveback(vhc, urbp);
 }
 
 static struct usb_vhci_ifc vhci_ioc_ifc = {
@@ -163,12 +516,9 @@ static struct usb_vhci_ifc vhci_ioc_ifc = {
 	.owner         = THIS_MODULE,
 	.ifc_priv_size = sizeof(struct vhci_ifc_priv),
 
-#ifdef DEBUG
+	.init    = init_ifc_priv,
 	.destroy = destroy_ifc_priv,
-#endif
-
-	.init   = init_ifc_priv,
-	.wakeup = trigger_work_event
+	.wakeup  = trigger_work_event
 };
 
 static int device_open(struct inode *inode, struct file *file)
@@ -238,7 +588,22 @@ static int device_release(struct inode *inode, struct file *file)
 	file->private_data = NULL;
 
 	if(likely(vdev))
+	{
+		// the window can't be mapped anymore, because every vma holds a reference on the file
+		run_revokes(vhcidev_to_ifcp(vdev), vhcidev_to_vhcihcd(vdev));
+		free_rings(vhcidev_to_ifcp(vdev));
+#ifndef NO_EVENTFD_CTX
+		set_eventfd(vhcidev_to_ifcp(vdev), NULL);
+#endif
+#ifndef NO_USE_MM
+		// every pending aio read holds a reference on the file, so the list is empty, but the
+		// worker may still be busy with the last one
+		cancel_work_sync(&vhcidev_to_ifcp(vdev)->aio_work);
+#endif
+		free_bounce_pool(vhcidev_to_ifcp(vdev));
+		release_fixed_buffers(vhcidev_to_ifcp(vdev)->fixed, vhcidev_to_ifcp(vdev)->fixed_count);
 		usb_vhci_hcd_unregister(vdev);
+	}
 	else
 		vhci_dbg("was not configured\n");
 
@@ -246,24 +611,6 @@ static int device_release(struct inode *inode, struct file *file)
 	return 0;
 }
 
-static ssize_t device_read(struct file *file,
-                           char __user *buffer,
-                           size_t length,
-                           loff_t *offset)
-{
-	vhci_dbg("%s(file=%p)\n", __FUNCTION__, file);
-	return -ENODEV;
-}
-
-static ssize_t device_write(struct file *file,
-                            const char __user *buffer,
-                            size_t length,
-                            loff_t *offset)
-{
-	vhci_dbg("%s(file=%p)\n", __FUNCTION__, file);
-	return -ENODEV;
-}
-
 // called in device_ioctl only
 static int ioc_port_stat(struct usb_vhci_device *vdev, struct usb_vhci_ioc_port_stat __user *arg)
 {
@@ -304,25 +651,76 @@ static inline u16 conv_urb_flags(unsigned int flags)
 static inline void dump_urb(struct urb *urb) {/* do nothing */}
 #endif
 
-// called in device_ioctl only
-static int ioc_fetch_work(struct usb_vhci_hcd *vhc, struct usb_vhci_ioc_work __user *arg, s16 timeout)
+// Like wait_event_interruptible_timeout, but the waiter is queued exclusively (see pass_on_work).
+// Returns the remaining jiffies (at least 1) if there is work, 0 on timeout or -ERESTARTSYS.
+// A timeout of MAX_SCHEDULE_TIMEOUT waits forever.
+static long wait_work_exclusive(struct vhci_ifc_priv *ifcp, struct usb_vhci_hcd *vhc, long timeout)
+{
+	DEFINE_WAIT(wait);
+
+	for(;;)
+	{
+		prepare_to_wait_exclusive(&ifcp->work_event, &wait, TASK_INTERRUPTIBLE);
+		if(usb_vhci_hcd_has_work(vhc))
+		{
+			if(!timeout)
+				timeout = 1;
+			break;
+		}
+		if(unlikely(signal_pending(current)))
+		{
+			timeout = -ERESTARTSYS;
+			break;
+		}
+		if(!timeout)
+			break;
+		timeout = schedule_timeout(timeout);
+	}
+	finish_wait(&ifcp->work_event, &wait);
+
+	// we may have been woken up for work which we are not going to take now
+	if(unlikely(timeout <= 0) && usb_vhci_hcd_has_work(vhc))
+		pass_on_work(ifcp);
+	return timeout;
+}
+
+// Spins for up to busy_poll_us microseconds, waiting for work. The budget is only spent if events
+// have recently been arriving faster than that, because otherwise spinning would most likely be
+// in vain. Returns nonzero if there is work.
+// called in wait_for_work only
+static int busy_poll(struct vhci_ifc_priv *ifcp, struct usb_vhci_hcd *vhc)
+{
+	unsigned long budget = ifcp->busy_poll_us * NSEC_PER_USEC;
+	s64 end;
+
+	if(!budget || ifcp->arrival_avg_ns > budget)
+		return 0;
+
+	end = ktime_to_ns(ktime_get()) + budget;
+	do
+	{
+		cpu_relax();
+		if(usb_vhci_hcd_has_work(vhc))
+		{
+			atomic_inc(&vhc->stat_busy_poll_hits);
+			return 1;
+		}
+		if(need_resched() || signal_pending(current))
+			break;
+	} while(ktime_to_ns(ktime_get()) < end);
+
+	atomic_inc(&vhc->stat_busy_poll_misses);
+	return 0;
+}
+
+// Waits until there is work to do or until timeout (in milliseconds) elapsed. A timeout of zero
+// only checks, a negative timeout waits forever. On success, the caller is draining and has to
+// call drain_end while it holds vhc->lock for fetching the work.
+// called in ioc_fetch_work{,_batch,_data_common} only
+static int wait_for_work(struct usb_vhci_hcd *vhc, s16 timeout)
 {
-#ifdef DEBUG
-	struct device *dev = vhcihcd_to_dev(vhc);
-#endif
-	struct usb_vhci_urb_priv *urbp;
 	struct vhci_ifc_priv *ifcp;
-	struct usb_vhci_port port_stat;
-	struct usb_vhci_ioc_urb urb;
-	u64 handle;
-	unsigned long flags;
 	long wret;
-	u8 _port, port;
-
-#ifdef DEBUG
-	// Floods the logs
-	//if(debug_output) dev_dbg(dev, "cmd=USB_VHCI_HCD_IOCFETCHWORK\n");
-#endif
 
 	ifcp = vhcihcd_to_ifcp(vhc);
 
@@ -330,10 +728,10 @@ static int ioc_fetch_work(struct usb_vhci_hcd *vhc, struct usb_vhci_ioc_work __u
 	{
 		if(timeout > 1000)
 			timeout = 1000;
-		if(timeout > 0)
-			wret = wait_event_interruptible_timeout(ifcp->work_event, usb_vhci_hcd_has_work(vhc), msecs_to_jiffies(timeout));
+		if(usb_vhci_hcd_has_work(vhc) || busy_poll(ifcp, vhc))
+			wret = 1;
 		else
-			wret = wait_event_interruptible(ifcp->work_event, usb_vhci_hcd_has_work(vhc));
+			wret = wait_work_exclusive(ifcp, vhc, timeout > 0 ? (long)msecs_to_jiffies(timeout) : MAX_SCHEDULE_TIMEOUT);
 		if(unlikely(wret < 0))
 		{
 			if(likely(wret == -ERESTARTSYS))
@@ -348,19 +746,120 @@ static int ioc_fetch_work(struct usb_vhci_hcd *vhc, struct usb_vhci_ioc_work __u
 		if(!usb_vhci_hcd_has_work(vhc))
 			return -ETIMEDOUT;
 	}
+	drain_begin(ifcp);
+	return 0;
+}
+
+// Same as wait_work_exclusive, but the timeout is handled by a high-resolution timer, which
+// expires at expires (mode is HRTIMER_MODE_ABS or HRTIMER_MODE_REL).
+// Returns 0 if there is work, -ETIMEDOUT or -EINTR.
+static int wait_work_hrtimer(struct vhci_ifc_priv *ifcp, struct usb_vhci_hcd *vhc, ktime_t expires, clockid_t clock, enum hrtimer_mode mode)
+{
+	struct hrtimer_sleeper t;
+	DEFINE_WAIT(wait);
+	int ret;
+
+	// (t is on the stack, which the timer debug objects want to know about)
+	hrtimer_init_on_stack(&t.timer, clock, mode);
+	hrtimer_init_sleeper(&t, current);
+	hrtimer_start(&t.timer, expires, mode);
+
+	for(;;)
+	{
+		prepare_to_wait_exclusive(&ifcp->work_event, &wait, TASK_INTERRUPTIBLE);
+		if(usb_vhci_hcd_has_work(vhc))
+		{
+			ret = 0;
+			break;
+		}
+		if(!t.task)
+		{
+			ret = -ETIMEDOUT;
+			break;
+		}
+		if(unlikely(signal_pending(current)))
+		{
+			ret = -EINTR;
+			break;
+		}
+		schedule();
+	}
+	finish_wait(&ifcp->work_event, &wait);
+	hrtimer_cancel(&t.timer);
+	destroy_hrtimer_on_stack(&t.timer);
+
+	// we may have been woken up for work which we are not going to take now
+	if(unlikely(ret) && usb_vhci_hcd_has_work(vhc))
+		pass_on_work(ifcp);
+	return ret;
+}
+
+// Same as wait_for_work, but with a timeout in nanoseconds (see struct usb_vhci_ioc_work_ns).
+// called in ioc_fetch_work_ns only
+static int wait_for_work_ns(struct usb_vhci_hcd *vhc, s64 timeout, u32 flags)
+{
+	struct vhci_ifc_priv *ifcp;
+	clockid_t clock;
+	long wret;
+	int ret;
+
+	ifcp = vhcihcd_to_ifcp(vhc);
+	clock = (flags & USB_VHCI_TIMEOUT_REALTIME) ? CLOCK_REALTIME : CLOCK_MONOTONIC;
+
+	if(usb_vhci_hcd_has_work(vhc) || busy_poll(ifcp, vhc))
+		goto work;
+	if(timeout < 0)
+	{
+		wret = wait_work_exclusive(ifcp, vhc, MAX_SCHEDULE_TIMEOUT);
+		if(unlikely(wret < 0))
+			return (wret == -ERESTARTSYS) ? -EINTR : wret;
+	}
+	else if(timeout || (flags & USB_VHCI_TIMEOUT_ABS))
+	{
+		ret = wait_work_hrtimer(ifcp, vhc, ns_to_ktime(timeout), clock, (flags & USB_VHCI_TIMEOUT_ABS) ? HRTIMER_MODE_ABS : HRTIMER_MODE_REL);
+		if(ret)
+			return ret;
+	}
+	else
+		return -ETIMEDOUT;
+
+work:
+	drain_begin(ifcp);
+	return 0;
+}
+
+// Takes the next piece of work and describes it in *work. Canceled urbs are reported first, then
+// port status changes and then the urbs from the inbox.
+// If urbp_ret isn't NULL, it receives the urb for USB_VHCI_WORK_TYPE_PROCESS_URB (and NULL for the
+// other work types).
+// Returns -ENODATA if there is nothing to do.
+// caller has vhc->lock and has irq disabled
+static int fetch_work_locked(struct usb_vhci_hcd *vhc, struct usb_vhci_ioc_work *work, struct usb_vhci_urb_priv **urbp_ret)
+{
+#ifdef DEBUG
+	struct device *dev = vhcihcd_to_dev(vhc);
+#endif
+	struct usb_vhci_urb_priv *urbp;
+	struct vhci_ifc_priv *ifcp;
+	u8 _port, port;
+
+	ifcp = vhcihcd_to_ifcp(vhc);
+	memset(work, 0, sizeof *work);
+	if(urbp_ret)
+		*urbp_ret = NULL;
 
-	spin_lock_irqsave(&vhc->lock, flags);
 	if(!list_empty(&vhc->urbp_list_cancel))
 	{
 		urbp = list_entry(vhc->urbp_list_cancel.next, struct usb_vhci_urb_priv, urbp_list);
 #ifdef DEBUG
-		if(debug_output) dev_dbg(dev, "cmd=USB_VHCI_HCD_IOCFETCHWORK [work=CANCEL_URB handle=0x%016llx]\n", (u64)(unsigned long)urbp->urb);
+		if(debug_output) dev_dbg(dev, "cmd=USB_VHCI_HCD_IOCFETCHWORK [work=CANCEL_URB handle=0x%016llx]\n", urbp->handle);
 #endif
-		handle = (u64)(unsigned long)urbp->urb;
-		list_move_tail(&urbp->urbp_list, &vhc->urbp_list_canceling);
-		spin_unlock_irqrestore(&vhc->lock, flags);
-		__put_user(USB_VHCI_WORK_TYPE_CANCEL_URB, &arg->type);
-		__put_user(handle, &arg->handle);
+		work->type = USB_VHCI_WORK_TYPE_CANCEL_URB;
+		work->handle = urbp->handle;
+		usb_vhci_urb_set_state(vhc, urbp, USB_VHCI_URB_STATE_CANCELING);
+		// user space must not see the data anymore after it has been told about the cancelation
+		if(unlikely(urbp->data_mapped))
+			revoke_locked(ifcp, urbp);
 		return 0;
 	}
 
@@ -376,32 +875,31 @@ static int ioc_fetch_work(struct usb_vhci_hcd *vhc, struct usb_vhci_ioc_work __u
 			if(vhc->port_update & (1 << (port + 1)))
 			{
 				vhc->port_update &= ~(1 << (port + 1));
+				usb_vhci_update_work_pending(vhc);
 				ifcp->port_sched_offset = port + 1;
-				port_stat = vhc->ports[port];
-				spin_unlock_irqrestore(&vhc->lock, flags);
 #ifdef DEBUG
-				if(debug_output) dev_dbg(dev, "cmd=USB_VHCI_HCD_IOCFETCHWORK [work=PORT_STAT port=%d status=0x%04x change=0x%04x]\n", (int)(port + 1), (int)port_stat.port_status, (int)port_stat.port_change);
+				if(debug_output) dev_dbg(dev, "cmd=USB_VHCI_HCD_IOCFETCHWORK [work=PORT_STAT port=%d status=0x%04x change=0x%04x]\n", (int)(port + 1), (int)vhc->ports[port].port_status, (int)vhc->ports[port].port_change);
 #endif
-				__put_user(USB_VHCI_WORK_TYPE_PORT_STAT, &arg->type);
-				__put_user(port + 1, &arg->work.port.index);
-				__put_user(port_stat.port_status, &arg->work.port.status);
-				__put_user(port_stat.port_change, &arg->work.port.change);
-				__put_user(port_stat.port_flags, &arg->work.port.flags);
+				work->type = USB_VHCI_WORK_TYPE_PORT_STAT;
+				work->work.port.index = port + 1;
+				work->work.port.status = vhc->ports[port].port_status;
+				work->work.port.change = vhc->ports[port].port_change;
+				work->work.port.flags = vhc->ports[port].port_flags;
 				return 0;
 			}
 		}
 	}
 
 repeat:
-	if(!list_empty(&vhc->urbp_list_inbox))
-	{
-		urbp = list_entry(vhc->urbp_list_inbox.next, struct usb_vhci_urb_priv, urbp_list);
-		handle = (u64)(unsigned long)urbp->urb;
-		memset(&urb, 0, sizeof urb);
-		urb.address = usb_pipedevice(urbp->urb->pipe);
-		urb.endpoint = usb_pipeendpoint(urbp->urb->pipe) | (usb_pipein(urbp->urb->pipe) ? 0x80 : 0x00);
-		urb.type = conv_urb_type(usb_pipetype(urbp->urb->pipe));
-		urb.flags = conv_urb_flags(urbp->urb->transfer_flags);
+	urbp = usb_vhci_inbox_next(vhc);
+	if(urbp)
+	{
+		struct usb_vhci_ioc_urb *const urb = &work->work.urb;
+		memset(urb, 0, sizeof *urb);
+		urb->address = usb_pipedevice(urbp->urb->pipe);
+		urb->endpoint = usb_pipeendpoint(urbp->urb->pipe) | (usb_pipein(urbp->urb->pipe) ? 0x80 : 0x00);
+		urb->type = conv_urb_type(usb_pipetype(urbp->urb->pipe));
+		urb->flags = conv_urb_flags(urbp->urb->transfer_flags);
 		if(usb_pipecontrol(urbp->urb->pipe))
 		{
 			const struct usb_ctrlrequest *cmd;
@@ -424,12 +922,12 @@ repeat:
 				if(unlikely(wLength && !urbp->urb->transfer_buffer))
 					goto invalid_urb;
 			}
-			urb.buffer_length = wLength;
-			urb.setup_packet.bmRequestType = cmd->bRequestType;
-			urb.setup_packet.bRequest = cmd->bRequest;
-			urb.setup_packet.wValue = wValue;
-			urb.setup_packet.wIndex = wIndex;
-			urb.setup_packet.wLength = wLength;
+			urb->buffer_length = wLength;
+			urb->setup_packet.bmRequestType = cmd->bRequestType;
+			urb->setup_packet.bRequest = cmd->bRequest;
+			urb->setup_packet.wValue = wValue;
+			urb->setup_packet.wIndex = wIndex;
+			urb->setup_packet.wLength = wLength;
 		}
 		else
 		{
@@ -443,308 +941,2174 @@ repeat:
 				if(unlikely(urbp->urb->transfer_buffer_length && !urbp->urb->transfer_buffer))
 					goto invalid_urb;
 			}
-			urb.buffer_length = urbp->urb->transfer_buffer_length;
+			urb->buffer_length = urbp->urb->transfer_buffer_length;
 		}
-		urb.interval = urbp->urb->interval;
-		urb.packet_count = urbp->urb->number_of_packets;
+		urb->interval = urbp->urb->interval;
+		urb->packet_count = urbp->urb->number_of_packets;
 
 #ifdef DEBUG
-		if(debug_output) dev_dbg(dev, "cmd=USB_VHCI_HCD_IOCFETCHWORK [work=PROCESS_URB handle=0x%016llx]\n", handle);
+		if(debug_output) dev_dbg(dev, "cmd=USB_VHCI_HCD_IOCFETCHWORK [work=PROCESS_URB handle=0x%016llx]\n", urbp->handle);
 #endif
 		dump_urb(urbp->urb);
-		list_move_tail(&urbp->urbp_list, &vhc->urbp_list_fetched);
-		spin_unlock_irqrestore(&vhc->lock, flags);
-
-		__put_user(USB_VHCI_WORK_TYPE_PROCESS_URB, &arg->type);
-		__put_user(handle, &arg->handle);
-		if(unlikely(__copy_to_user(&arg->work.urb, &urb, sizeof urb)))
-			return -EFAULT;
+		work->type = USB_VHCI_WORK_TYPE_PROCESS_URB;
+		work->handle = urbp->handle;
+		usb_vhci_urb_set_state(vhc, urbp, USB_VHCI_URB_STATE_FETCHED);
+		if(urbp_ret)
+			*urbp_ret = urbp;
 		return 0;
 
 	invalid_urb:
 		// reject invalid urbs immediately
 #ifdef DEBUG
-		if(debug_output) dev_dbg(dev, "cmd=USB_VHCI_HCD_IOCFETCHWORK  <<< THROWING AWAY INVALID URB >>>  [handle=0x%016llx]\n", handle);
+		if(debug_output) dev_dbg(dev, "cmd=USB_VHCI_HCD_IOCFETCHWORK  <<< THROWING AWAY INVALID URB >>>  [handle=0x%016llx]\n", urbp->handle);
 #endif
 		usb_vhci_maybe_set_status(urbp, -EPIPE);
 		usb_vhci_urb_giveback(vhc, urbp);
 		goto repeat;
 	}
 
-	spin_unlock_irqrestore(&vhc->lock, flags);
 	return -ENODATA;
 }
 
-// caller has lock
-static inline struct usb_vhci_urb_priv *urbp_from_handle(struct usb_vhci_hcd *vhc, const void *handle)
+// copies the work to user space, but leaves the timeout field untouched
+// called in ioc_fetch_work{,_data_common} only
+static int put_work(struct usb_vhci_ioc_work __user *arg, const struct usb_vhci_ioc_work *work)
 {
-	struct usb_vhci_urb_priv *entry;
-	list_for_each_entry(entry, &vhc->urbp_list_fetched, urbp_list)
-		if(entry->urb == handle)
-			return entry;
-	return NULL;
+	__put_user(work->type, &arg->type);
+	switch(work->type)
+	{
+	case USB_VHCI_WORK_TYPE_PORT_STAT:
+		__put_user(work->work.port.index, &arg->work.port.index);
+		__put_user(work->work.port.status, &arg->work.port.status);
+		__put_user(work->work.port.change, &arg->work.port.change);
+		__put_user(work->work.port.flags, &arg->work.port.flags);
+		return 0;
+	case USB_VHCI_WORK_TYPE_PROCESS_URB:
+		__put_user(work->handle, &arg->handle);
+		if(unlikely(__copy_to_user(&arg->work.urb, &work->work.urb, sizeof work->work.urb)))
+			return -EFAULT;
+		return 0;
+	default:
+		__put_user(work->handle, &arg->handle);
+		return 0;
+	}
 }
 
-// caller has lock
-static inline struct usb_vhci_urb_priv *urbp_from_handle_in_cancel(struct usb_vhci_hcd *vhc, const void *handle)
+#ifndef NO_EVENTFD_CTX
+// Replaces the eventfd (ctx may be NULL) and drops the reference on the old one.
+// called in ioc_set_eventfd and device_release only
+static void set_eventfd(struct vhci_ifc_priv *ifcp, struct eventfd_ctx *ctx)
 {
-	struct usb_vhci_urb_priv *entry;
-	list_for_each_entry(entry, &vhc->urbp_list_cancel, urbp_list)
-		if(entry->urb == handle)
-			return entry;
-	return NULL;
-}
+	struct eventfd_ctx *old;
+	unsigned long flags;
 
-// caller has lock
-static inline struct usb_vhci_urb_priv *urbp_from_handle_in_canceling(struct usb_vhci_hcd *vhc, const void *handle)
-{
-	struct usb_vhci_urb_priv *entry;
-	list_for_each_entry(entry, &vhc->urbp_list_canceling, urbp_list)
-		if(entry->urb == handle)
-			return entry;
-	return NULL;
+	spin_lock_irqsave(&ifcp->ring_lock, flags);
+	old = ifcp->eventfd;
+	ifcp->eventfd = ctx;
+	spin_unlock_irqrestore(&ifcp->ring_lock, flags);
+	if(old)
+		eventfd_ctx_put(old);
 }
 
-// caller has lock
-static inline int is_urb_dir_in(const struct urb *urb)
+// called in device_ioctl only
+static int ioc_set_eventfd(struct usb_vhci_hcd *vhc, const struct usb_vhci_ioc_eventfd __user *arg)
 {
-	if(unlikely(usb_pipecontrol(urb->pipe)))
+	struct vhci_ifc_priv *ifcp = vhcihcd_to_ifcp(vhc);
+	struct eventfd_ctx *ctx = NULL;
+	unsigned long flags;
+	s32 fd;
+
+	__get_user(fd, &arg->fd);
+
+#ifdef DEBUG
+	if(debug_output) dev_dbg(vhcihcd_to_dev(vhc), "cmd=USB_VHCI_HCD_IOCSET_EVENTFD [fd=%d]\n", (int)fd);
+#endif
+
+	if(fd >= 0)
 	{
-		const struct usb_ctrlrequest *cmd = (struct usb_ctrlrequest *)urb->setup_packet;
-		return cmd->bRequestType & 0x80;
+		ctx = eventfd_ctx_fdget(fd);
+		if(unlikely(IS_ERR(ctx)))
+			return PTR_ERR(ctx);
 	}
-	else
-		return usb_pipein(urb->pipe);
+	set_eventfd(ifcp, ctx);
+
+	// work which is pending already won't cause an edge anymore
+	if(ctx && usb_vhci_hcd_has_work(vhc))
+	{
+		spin_lock_irqsave(&ifcp->ring_lock, flags);
+		if(ifcp->eventfd)
+			eventfd_signal(ifcp->eventfd, 1);
+		spin_unlock_irqrestore(&ifcp->ring_lock, flags);
+	}
+	return 0;
 }
+#endif
 
-// -ECANCELED doesn't report an error, but it indicates that the urb was in the "cancel"
-// list or in the "canceling" list.
-// If this function reports an error (other than -ENOENT), then the urb will be given back to its creator anyway,
-// if its handle was found. (If its handle wasn't found, then -ENOENT is returned.)
-// called in ioc_giveback{,32} only
-static int ioc_giveback_common(struct usb_vhci_hcd *vhc, const void *handle, int status, int act, int iso_count, int err_count, const void __user *buf, const struct usb_vhci_ioc_iso_packet_giveback __user *iso)
+// called in device_ioctl only
+static int ioc_set_busy_poll(struct usb_vhci_hcd *vhc, const struct usb_vhci_ioc_busy_poll __user *arg)
 {
-	struct usb_vhci_urb_priv *urbp;
+	struct vhci_ifc_priv *ifcp = vhcihcd_to_ifcp(vhc);
 	unsigned long flags;
-	int retval = 0, is_in, is_iso, i;
-#ifdef DEBUG
-	struct device *dev = vhcihcd_to_dev(vhc);
-#endif
+	u32 budget;
 
-	// TODO: do we really need to disable interrupts for accessing the urb lists?
-	spin_lock_irqsave(&vhc->lock, flags);
+	__get_user(budget, &arg->budget_us);
+	if(budget > USB_VHCI_BUSY_POLL_MAX)
+		budget = USB_VHCI_BUSY_POLL_MAX;
 
-	if(unlikely(!(urbp = urbp_from_handle(vhc, handle))))
-	{
-		// if not found, check the cancel{,ing} list
-		if(likely((urbp = urbp_from_handle_in_canceling(vhc, handle)) ||
-			(urbp = urbp_from_handle_in_cancel(vhc, handle))))
-		{
 #ifdef DEBUG
-			if(debug_output) dev_dbg(dev, "GIVEBACK: urb was canceled\n");
+	if(debug_output) dev_dbg(vhcihcd_to_dev(vhc), "cmd=USB_VHCI_HCD_IOCSET_BUSY_POLL [budget_us=%u]\n", budget);
 #endif
-			retval = -ECANCELED;
+
+	// start over with the statistics of the inter-arrival times
+	spin_lock_irqsave(&ifcp->ring_lock, flags);
+	ifcp->busy_poll_us = budget;
+	ifcp->last_arrival = ktime_get();
+	ifcp->arrival_avg_ns = 0;
+	spin_unlock_irqrestore(&ifcp->ring_lock, flags);
+	return 0;
+}
+
+// Fetches one piece of work after wait_for_work{,_ns} has succeeded.
+// called in ioc_fetch_work{,_ns} only
+static int take_work(struct usb_vhci_hcd *vhc, struct usb_vhci_ioc_work __user *arg)
+{
+	struct usb_vhci_ioc_work work;
+	unsigned long flags;
+	int ret, more;
+
+	spin_lock_irqsave(&vhc->lock, flags);
+	ret = fetch_work_locked(vhc, &work, NULL);
+	more = drain_end(vhcihcd_to_ifcp(vhc), vhc);
+	spin_unlock_irqrestore(&vhc->lock, flags);
+	if(more)
+		pass_on_work(vhcihcd_to_ifcp(vhc));
+	if(ret)
+		return ret;
+
+	return put_work(arg, &work);
+}
+
+// called in device_ioctl only
+static int ioc_fetch_work(struct usb_vhci_hcd *vhc, struct usb_vhci_ioc_work __user *arg, s16 timeout)
+{
+	int ret;
+
+#ifdef DEBUG
+	// Floods the logs
+	//if(debug_output) dev_dbg(vhcihcd_to_dev(vhc), "cmd=USB_VHCI_HCD_IOCFETCHWORK\n");
+#endif
+
+	ret = wait_for_work(vhc, timeout);
+	if(ret)
+		return ret;
+
+	return take_work(vhc, arg);
+}
+
+// called in device_ioctl only
+static int ioc_fetch_work_ns(struct usb_vhci_hcd *vhc, struct usb_vhci_ioc_work_ns __user *arg)
+{
+	s64 timeout;
+	u32 flags;
+	int ret;
+
+	__get_user(timeout, &arg->timeout_ns);
+	__get_user(flags, &arg->flags);
+	if(unlikely(flags & ~(USB_VHCI_TIMEOUT_ABS | USB_VHCI_TIMEOUT_REALTIME)))
+		return -EINVAL;
+
+	ret = wait_for_work_ns(vhc, timeout, flags);
+	if(ret)
+		return ret;
+
+	return take_work(vhc, &arg->work);
+}
+
+// Fills the user array with up to count pieces of work, all of them taken during a single hold
+// of vhc->lock. The number of filled entries is written to *count_ret.
+// called in ioc_fetch_work_batch{,32} and ioc_giveback_fetch{,32} only
+static int ioc_fetch_work_batch_common(struct usb_vhci_hcd *vhc, struct usb_vhci_ioc_work __user *user_work, int count, s16 timeout, __s32 __user *count_ret)
+{
+	struct usb_vhci_ioc_work *work;
+	unsigned long flags;
+	int ret, more, n = 0;
+
+	if(unlikely(count <= 0 || !user_work))
+		return -EINVAL;
+	if(count > USB_VHCI_WORK_BATCH_MAX)
+		count = USB_VHCI_WORK_BATCH_MAX;
+	if(unlikely(!access_ok(VERIFY_WRITE, user_work, count * sizeof *work)))
+		return -EFAULT;
+
+	work = get_bounce(vhcihcd_to_ifcp(vhc), count * sizeof *work);
+	if(unlikely(!work))
+		return -ENOMEM;
+
+	ret = wait_for_work(vhc, timeout);
+	if(ret)
+		goto end;
+
+	spin_lock_irqsave(&vhc->lock, flags);
+	while(n < count && !fetch_work_locked(vhc, &work[n], NULL))
+		n++;
+	more = drain_end(vhcihcd_to_ifcp(vhc), vhc);
+	spin_unlock_irqrestore(&vhc->lock, flags);
+	if(more)
+		pass_on_work(vhcihcd_to_ifcp(vhc));
+
+#ifdef DEBUG
+	if(debug_output) dev_dbg(vhcihcd_to_dev(vhc), "cmd=USB_VHCI_HCD_IOCFETCHWORK_BATCH [count=%d]\n", n);
+#endif
+
+	if(unlikely(!n))
+		ret = -ENODATA;
+	else if(unlikely(__copy_to_user(user_work, work, n * sizeof *work)))
+		ret = -EFAULT;
+
+end:
+	__put_user(n, count_ret);
+	put_bounce(vhcihcd_to_ifcp(vhc), work, count * sizeof *work);
+	return ret;
+}
+
+// called in device_ioctl only
+static int ioc_fetch_work_batch(struct usb_vhci_hcd *vhc, struct usb_vhci_ioc_work_batch __user *arg)
+{
+	struct usb_vhci_ioc_work __user *user_work;
+	s32 count;
+	s16 timeout;
+
+	__get_user(user_work, &arg->work);
+	__get_user(count, &arg->count);
+	__get_user(timeout, &arg->timeout);
+	return ioc_fetch_work_batch_common(vhc, user_work, count, timeout, &arg->count);
+}
+
+// Returns the urb which belongs to the handle, if it is in the "fetched", "cancel" or "canceling" list.
+// (Urbs in the inbox were not handed to user space yet and urbs which are about to be given back are
+// already gone, so user space can't have a valid handle for them.)
+// caller has lock
+static inline struct usb_vhci_urb_priv *urbp_from_handle(struct usb_vhci_hcd *vhc, u64 handle)
+{
+	struct usb_vhci_urb_priv *urbp = usb_vhci_urbp_from_handle(vhc, handle);
+	if(unlikely(!urbp))
+		return NULL;
+	switch(urbp->state)
+	{
+	case USB_VHCI_URB_STATE_FETCHED:
+	case USB_VHCI_URB_STATE_CANCEL:
+	case USB_VHCI_URB_STATE_CANCELING:
+		return urbp;
+	default:
+		return NULL;
+	}
+}
+
+// caller has lock
+static inline int is_urb_dir_in(const struct urb *urb)
+{
+	if(unlikely(usb_pipecontrol(urb->pipe)))
+	{
+		const struct usb_ctrlrequest *cmd = (struct usb_ctrlrequest *)urb->setup_packet;
+		return cmd->bRequestType & 0x80;
+	}
+	else
+		return usb_pipein(urb->pipe);
+}
+
+// Unpins the pages of the registered buffers and frees the array.
+static void release_fixed_buffers(struct vhci_fixed_buffer *fixed, unsigned int count)
+{
+	unsigned int i, j;
+
+	for(i = 0; i < count; i++)
+	{
+		for(j = 0; j < fixed[i].page_count; j++)
+			page_cache_release(fixed[i].pages[j]);
+		kfree(fixed[i].pages);
+	}
+	kfree(fixed);
+}
+
+// Pins the pages of a user buffer.
+// called in ioc_register_buffers only
+static int pin_fixed_buffer(struct vhci_fixed_buffer *fb)
+{
+	int ret, i;
+
+	fb->page_count = (offset_in_page(fb->address) + fb->length + PAGE_SIZE - 1) >> PAGE_SHIFT;
+	fb->pages = kmalloc(fb->page_count * sizeof *fb->pages, GFP_KERNEL);
+	if(unlikely(!fb->pages))
+		return -ENOMEM;
+
+	// We ask for write access (although we only read from the pages), so that copy-on-write
+	// pages are broken up now. Otherwise user space might write into a copy of a page we have
+	// pinned.
+	down_read(&current->mm->mmap_sem);
+	ret = get_user_pages(current, current->mm, fb->address & PAGE_MASK, fb->page_count, 1, 0, fb->pages, NULL);
+	up_read(&current->mm->mmap_sem);
+	if(likely(ret == fb->page_count))
+		return 0;
+
+	for(i = 0; i < ret; i++)
+		page_cache_release(fb->pages[i]);
+	kfree(fb->pages);
+	fb->pages = NULL;
+	fb->page_count = 0;
+	return ret < 0 ? ret : -EFAULT;
+}
+
+// Replaces the registered buffers.
+// called in device_ioctl only
+static int ioc_register_buffers(struct usb_vhci_hcd *vhc, const struct usb_vhci_ioc_register_buffers __user *arg)
+{
+	struct vhci_ifc_priv *ifcp = vhcihcd_to_ifcp(vhc);
+	const struct usb_vhci_ioc_buffer __user *user_buffers;
+	struct vhci_fixed_buffer *fixed = NULL, *old;
+	struct usb_vhci_ioc_buffer tmp;
+	unsigned int i, old_count;
+	u64 buffers;
+	u32 count;
+	int ret;
+
+	__get_user(buffers, &arg->buffers);
+	__get_user(count, &arg->count);
+
+#ifdef DEBUG
+	if(debug_output) dev_dbg(vhcihcd_to_dev(vhc), "cmd=USB_VHCI_HCD_IOCREGISTER_BUFFERS [count=%u]\n", count);
+#endif
+
+	if(unlikely(count > USB_VHCI_FIXED_BUFFERS_MAX))
+		return -EINVAL;
+	user_buffers = (const struct usb_vhci_ioc_buffer __user *)(unsigned long)buffers;
+
+	if(count)
+	{
+		fixed = kcalloc(count, sizeof *fixed, GFP_KERNEL);
+		if(unlikely(!fixed))
+			return -ENOMEM;
+	}
+	for(i = 0; i < count; i++)
+	{
+		if(unlikely(copy_from_user(&tmp, &user_buffers[i], sizeof tmp)))
+		{
+			ret = -EFAULT;
+			goto err;
 		}
-		else
+		if(unlikely(!tmp.address || !tmp.length || tmp.length > USB_VHCI_FIXED_BUFFER_MAX ||
+		            tmp.address != (unsigned long)tmp.address))
+		{
+			ret = -EINVAL;
+			goto err;
+		}
+		fixed[i].address = tmp.address;
+		fixed[i].length = tmp.length;
+		ret = pin_fixed_buffer(&fixed[i]);
+		if(unlikely(ret))
+			goto err;
+	}
+
+	// wait until nobody uses the old buffers anymore
+	down_write(&ifcp->fixed_sem);
+	old = ifcp->fixed;
+	old_count = ifcp->fixed_count;
+	ifcp->fixed = fixed;
+	ifcp->fixed_count = count;
+	up_write(&ifcp->fixed_sem);
+
+	release_fixed_buffers(old, old_count);
+	return 0;
+
+err:
+	release_fixed_buffers(fixed, i);
+	return ret;
+}
+
+// Copies len bytes, starting at offset off, from a registered buffer.
+// caller has ifcp->fixed_sem (for reading)
+static void copy_from_fixed(void *dst, const struct vhci_fixed_buffer *fb, u32 off, int len)
+{
+	unsigned long pos = offset_in_page(fb->address) + off;
+	unsigned int chunk;
+	struct page *page;
+	char *d = dst;
+
+	while(len > 0)
+	{
+		chunk = min_t(unsigned int, PAGE_SIZE - offset_in_page(pos), len);
+		page = fb->pages[pos >> PAGE_SHIFT];
+		memcpy(d, (char *)kmap(page) + offset_in_page(pos), chunk);
+		kunmap(page);
+		d += chunk;
+		pos += chunk;
+		len -= chunk;
+	}
+}
+
+// Checks that the total length of the segments fits into an int.
+static int check_iov(const struct iovec *iov, int count)
+{
+	size_t total = 0;
+	int i;
+
+	for(i = 0; i < count; i++)
+	{
+		if(unlikely(iov[i].iov_len > INT_MAX - total))
+			return -EINVAL;
+		total += iov[i].iov_len;
+	}
+	return 0;
+}
+
+// Copies an array of count segments from user space. (The segments themselves are checked by
+// copy_{to,from}_user when they are accessed.)
+static int import_iov(struct iovec *iov, const struct iovec __user *user_iov, int count)
+{
+	if(unlikely(copy_from_user(iov, user_iov, count * sizeof *iov)))
+		return -EFAULT;
+	return check_iov(iov, count);
+}
+
+#ifdef CONFIG_COMPAT
+static int import_iov32(struct iovec *iov, const struct compat_iovec __user *user_iov, int count)
+{
+	struct compat_iovec tmp;
+	int i;
+
+	for(i = 0; i < count; i++)
+	{
+		if(unlikely(copy_from_user(&tmp, &user_iov[i], sizeof tmp)))
+			return -EFAULT;
+		iov[i].iov_base = compat_ptr(tmp.iov_base);
+		iov[i].iov_len = tmp.iov_len;
+	}
+	return check_iov(iov, count);
+}
+#endif
+
+// Gathers len bytes from the segments of iov. (The caller has checked that the segments contain
+// at least len bytes.)
+static int copy_from_iov(void *dst, const struct iovec *iov, int len)
+{
+	char *d = dst;
+	size_t n;
+
+	for(; len > 0; iov++)
+	{
+		n = min_t(size_t, iov->iov_len, len);
+		if(unlikely(copy_from_user(d, iov->iov_base, n)))
+			return -EFAULT;
+		d += n;
+		len -= n;
+	}
+	return 0;
+}
+
+// kernel copy of the fields of usb_vhci_ioc_giveback{,32}
+struct vhci_giveback_desc
+{
+	u64 handle;
+	int status, act, iso_count, err_count;
+	const void __user *buf;
+	const struct usb_vhci_ioc_iso_packet_giveback __user *iso;
+	const struct vhci_fixed_buffer *fixed; // if not NULL, the IN data is taken from this registered
+	u32 fixed_offset;                      // buffer instead of buf (used by ioc_giveback_fixed only)
+	const struct iovec *iov; // if not NULL, the IN data is gathered from these segments instead of
+	int iov_count;           // from buf (used by ioc_giveback_iov{,32} only)
+	struct usb_vhci_urb_priv *urbp; // used by ioc_giveback_batch_common only
+	int result;                     // used by ioc_giveback_batch_common only
+	size_t offset;                  // used by device_write only (offset of the record)
+};
+
+// Checks whether the giveback fits to the urb, without touching user memory (except for
+// access_ok). Returns zero if it does.
+// called in giveback_copy and ioc_giveback_batch_common only
+static int giveback_check(struct usb_vhci_hcd *vhc, struct usb_vhci_urb_priv *urbp, const struct vhci_giveback_desc *gb)
+{
+	int is_in, is_iso;
+#ifdef DEBUG
+	struct device *dev = vhcihcd_to_dev(vhc);
+#endif
+
+	is_in = is_urb_dir_in(urbp->urb);
+	is_iso = usb_pipeisoc(urbp->urb->pipe);
+
+	if(unlikely(gb->act < 0))
+	{
+#ifdef DEBUG
+		if(debug_output) dev_dbg(dev, "GIVEBACK: invalid: buffer_actual < 0\n");
+#endif
+		return -EINVAL;
+	}
+	if(likely(is_iso))
+	{
+		if(unlikely(is_in && gb->act != urbp->urb->transfer_buffer_length))
 		{
 #ifdef DEBUG
-			if(debug_output) dev_dbg(dev, "GIVEBACK: handle not found\n");
+			if(debug_output) dev_dbg(dev, "GIVEBACK(ISO): invalid: buffer_actual != buffer_length\n");
 #endif
-			spin_unlock_irqrestore(&vhc->lock, flags);
-			return -ENOENT;
+			return -ENOBUFS;
+		}
+		if(unlikely(gb->iso_count != urbp->urb->number_of_packets))
+		{
+#ifdef DEBUG
+			if(debug_output) dev_dbg(dev, "GIVEBACK(ISO): invalid: number_of_packets missmatch\n");
+#endif
+			return -EINVAL;
+		}
+		if(unlikely(gb->iso_count && !gb->iso))
+		{
+#ifdef DEBUG
+			if(debug_output) dev_dbg(dev, "GIVEBACK(ISO): invalid: iso_packets must not be zero\n");
+#endif
+			return -EINVAL;
+		}
+		if(likely(gb->iso_count))
+		{
+			if(!access_ok(VERIFY_READ, (void *)gb->iso, gb->iso_count * sizeof(struct usb_vhci_ioc_iso_packet_giveback)))
+				return -EFAULT;
+		}
+	}
+	else if(unlikely(gb->act > urbp->urb->transfer_buffer_length))
+	{
+#ifdef DEBUG
+		if(debug_output) dev_dbg(dev, "GIVEBACK: invalid: buffer_actual > buffer_length\n");
+#endif
+		return is_in ? -ENOBUFS : -EINVAL;
+	}
+	if(is_in && gb->fixed)
+	{
+		if(unlikely(gb->fixed_offset > gb->fixed->length || gb->act > gb->fixed->length - gb->fixed_offset))
+		{
+#ifdef DEBUG
+			if(debug_output) dev_dbg(dev, "GIVEBACK: data exceeds the registered buffer\n");
+#endif
+			return -EINVAL;
+		}
+	}
+	else if(is_in && gb->iov)
+	{
+		if(unlikely(gb->act > iov_length(gb->iov, gb->iov_count)))
+		{
+#ifdef DEBUG
+			if(debug_output) dev_dbg(dev, "GIVEBACK: buffer_actual exceeds the segments\n");
+#endif
+			return -EINVAL;
+		}
+	}
+	else if(is_in)
+	{
+		if(unlikely(gb->act && !gb->buf))
+		{
+#ifdef DEBUG
+			if(debug_output) dev_dbg(dev, "GIVEBACK: buf must not be zero\n");
+#endif
+			return -EINVAL;
+		}
+	}
+	else if(unlikely(gb->buf))
+	{
+#ifdef DEBUG
+		if(debug_output) dev_dbg(dev, "GIVEBACK: invalid: buf should be NULL\n");
+#endif
+		// no data expected, so buf should be NULL
+		return -EINVAL;
+	}
+	return 0;
+}
+
+// Copies the IN data and the iso packet results from user space into the urb, which has to be
+// detached from the urb lists already (state USB_VHCI_URB_STATE_GIVEBACK).
+// Returns zero on success. (The status of the urb is not touched here.)
+// called in ioc_giveback{,_batch}_common only
+static int giveback_copy(struct usb_vhci_hcd *vhc, struct usb_vhci_urb_priv *urbp, const struct vhci_giveback_desc *gb)
+{
+	int is_in, is_iso, i, ret;
+#ifdef DEBUG
+	struct device *dev = vhcihcd_to_dev(vhc);
+#endif
+
+	ret = giveback_check(vhc, urbp, gb);
+	if(unlikely(ret))
+		return ret;
+
+	is_in = is_urb_dir_in(urbp->urb);
+	is_iso = usb_pipeisoc(urbp->urb->pipe);
+
+	if(is_in && gb->fixed)
+	{
+		// the pages are pinned, so this can't fault
+		copy_from_fixed(urbp->urb->transfer_buffer, gb->fixed, gb->fixed_offset, gb->act);
+	}
+	else if(is_in && gb->iov)
+	{
+		if(unlikely(copy_from_iov(urbp->urb->transfer_buffer, gb->iov, gb->act)))
+		{
+#ifdef DEBUG
+			if(debug_output) dev_dbg(dev, "GIVEBACK: copy_from_user(iov) failed\n");
+#endif
+			return -EFAULT;
 		}
 	}
+	else if(is_in)
+	{
+		if(unlikely(copy_from_user(urbp->urb->transfer_buffer, gb->buf, gb->act)))
+		{
+#ifdef DEBUG
+			if(debug_output) dev_dbg(dev, "GIVEBACK: copy_from_user(buf) failed\n");
+#endif
+			return -EFAULT;
+		}
+	}
+	if(likely(is_iso && gb->iso_count))
+	{
+		for(i = 0; i < gb->iso_count; i++)
+		{
+			__get_user(urbp->urb->iso_frame_desc[i].status, &gb->iso[i].status);
+			__get_user(urbp->urb->iso_frame_desc[i].actual_length, &gb->iso[i].packet_actual);
+		}
+	}
+	urbp->urb->actual_length = gb->act;
+	urbp->urb->error_count = gb->err_count;
+	return 0;
+}
+
+// Looks up the urb and removes it from the urb lists, so that nobody else can give it back.
+// Returns -ENOENT if the handle wasn't found, -EBUSY if the urb is pinned (its data is being read
+// by another thread) and -ECANCELED if the urb was in the "cancel" list or in the "canceling" list
+// (the urb is detached in this case, too).
+// caller has lock
+static int giveback_detach(struct usb_vhci_hcd *vhc, u64 handle, struct usb_vhci_urb_priv **urbp_ret)
+{
+	struct usb_vhci_urb_priv *urbp;
+	int retval = 0;
+#ifdef DEBUG
+	struct device *dev = vhcihcd_to_dev(vhc);
+#endif
+
+	*urbp_ret = NULL;
+	if(unlikely(!(urbp = urbp_from_handle(vhc, handle))))
+	{
+#ifdef DEBUG
+		if(debug_output) dev_dbg(dev, "GIVEBACK: handle not found\n");
+#endif
+		return -ENOENT;
+	}
+	if(unlikely(urbp->pin_count))
+	{
+#ifdef DEBUG
+		if(debug_output) dev_dbg(dev, "GIVEBACK: urb is still being read\n");
+#endif
+		return -EBUSY;
+	}
+	if(unlikely(urbp->state != USB_VHCI_URB_STATE_FETCHED))
+	{
+#ifdef DEBUG
+		if(debug_output) dev_dbg(dev, "GIVEBACK: urb was canceled\n");
+#endif
+		retval = -ECANCELED;
+	}
+
+	// remove urb from list before we release the spinlock
+	// (usb_vhci_urb_giveback() calls list_del(), too, so the entry gets re-initialized)
+	usb_vhci_urb_set_state(vhc, urbp, USB_VHCI_URB_STATE_GIVEBACK);
+	*urbp_ret = urbp;
+	return retval;
+}
+
+// -ECANCELED doesn't report an error, but it indicates that the urb was in the "cancel"
+// list or in the "canceling" list.
+// If this function reports an error (other than -ENOENT), then the urb will be given back to its creator anyway,
+// if its handle was found. (If its handle wasn't found, then -ENOENT is returned.)
+// called in ioc_giveback{,32} only
+static int ioc_giveback_common(struct usb_vhci_hcd *vhc, const struct vhci_giveback_desc *gb)
+{
+	struct usb_vhci_urb_priv *urbp;
+	unsigned long flags;
+	int retval, ret;
+#ifdef DEBUG
+	struct device *dev = vhcihcd_to_dev(vhc);
+#endif
+
+	// TODO: do we really need to disable interrupts for accessing the urb lists?
+	spin_lock_irqsave(&vhc->lock, flags);
+	retval = giveback_detach(vhc, gb->handle, &urbp);
+	spin_unlock_irqrestore(&vhc->lock, flags);
+	if(unlikely(!urbp))
+		return retval;
+
+	ret = giveback_copy(vhc, urbp, gb);
+	if(likely(!ret))
+	{
+		// now we are done with this urb and it can return to its creator
+		usb_vhci_maybe_set_status(urbp, gb->status);
+	}
+	else
+		retval = ret;
+
+	spin_lock_irqsave(&vhc->lock, flags);
+	ifc_giveback(vhc, urbp);
+	spin_unlock_irqrestore(&vhc->lock, flags);
+#ifdef DEBUG
+	if(debug_output) dev_dbg(dev, ret ? "GIVEBACK: done (with errors)\n" : "GIVEBACK: done\n");
+#endif
+	return retval;
+}
+
+// Gives back count urbs. All of them are looked up and detached during one hold of the lock and
+// all of them are returned to their creators during another one. The result of each entry
+// (the return value ioc_giveback_common would have returned for it) is stored in gb[i].result.
+// If stop is set, the batch ends at the first entry which can't be detached or which doesn't fit
+// to its urb; the entries after it are left alone. Returns the number of entries which were
+// handled. (A failing copy from user space doesn't stop the batch.)
+static int ioc_giveback_batch_common(struct usb_vhci_hcd *vhc, struct vhci_giveback_desc *gb, int count, int stop)
+{
+	unsigned long flags;
+	LIST_HEAD(done);
+	int i, ret;
+
+	spin_lock_irqsave(&vhc->lock, flags);
+	for(i = 0; i < count; i++)
+	{
+		gb[i].result = giveback_detach(vhc, gb[i].handle, &gb[i].urbp);
+		if(!stop)
+			continue;
+		if(gb[i].urbp && (ret = giveback_check(vhc, gb[i].urbp, &gb[i])))
+			gb[i].result = ret;
+		if(unlikely(gb[i].result && gb[i].result != -ECANCELED))
+		{
+			count = i + 1;
+			break;
+		}
+	}
+	spin_unlock_irqrestore(&vhc->lock, flags);
+
+	for(i = 0; i < count; i++)
+	{
+		if(unlikely(!gb[i].urbp))
+			continue;
+		ret = giveback_copy(vhc, gb[i].urbp, &gb[i]);
+		if(likely(!ret))
+			usb_vhci_maybe_set_status(gb[i].urbp, gb[i].status);
+		else
+			gb[i].result = ret;
+	}
+
+	spin_lock_irqsave(&vhc->lock, flags);
+	for(i = 0; i < count; i++)
+	{
+		if(unlikely(!gb[i].urbp))
+			continue;
+		if(unlikely(gb[i].urbp->data_mapped))
+			ifc_giveback(vhc, gb[i].urbp);
+		else
+			list_add_tail(&gb[i].urbp->urbp_list, &done);
+	}
+	usb_vhci_urb_giveback_list(vhc, &done);
+	spin_unlock_irqrestore(&vhc->lock, flags);
+	return count;
+}
+
+// called in device_ioctl only
+static int ioc_giveback(struct usb_vhci_hcd *vhc, const struct usb_vhci_ioc_giveback __user *arg)
+{
+	struct vhci_giveback_desc gb;
+
+#ifdef DEBUG
+	if(debug_output) dev_dbg(vhcihcd_to_dev(vhc), "cmd=USB_VHCI_HCD_IOCGIVEBACK\n");
+#endif
+
+	if(sizeof(void *) > 4)
+		__get_user(gb.handle, &arg->handle);
+	else
+	{
+		u32 handle1, handle2;
+		__get_user(handle1, (u32 __user *)&arg->handle);
+		__get_user(handle2, (u32 __user *)&arg->handle + 1);
+		*((u32 *)&gb.handle) = handle1;
+		*((u32 *)&gb.handle + 1) = handle2;
+	}
+	__get_user(gb.status, &arg->status);
+	__get_user(gb.act, &arg->buffer_actual);
+	__get_user(gb.iso_count, &arg->packet_count);
+	__get_user(gb.err_count, &arg->error_count);
+	__get_user(gb.buf, &arg->buffer);
+	__get_user(gb.iso, &arg->iso_packets);
+	gb.fixed = NULL;
+	gb.iov = NULL;
+	if(unlikely(!gb.handle))
+		return -EINVAL;
+	return ioc_giveback_common(vhc, &gb);
+}
+
+// called in device_ioctl only
+static int ioc_giveback_fixed(struct usb_vhci_hcd *vhc, const struct usb_vhci_ioc_giveback_fixed __user *arg)
+{
+	struct vhci_ifc_priv *ifcp = vhcihcd_to_ifcp(vhc);
+	struct usb_vhci_ioc_giveback_fixed tmp;
+	struct vhci_giveback_desc gb;
+	int ret;
+
+#ifdef DEBUG
+	if(debug_output) dev_dbg(vhcihcd_to_dev(vhc), "cmd=USB_VHCI_HCD_IOCGIVEBACK_FIXED\n");
+#endif
+
+	if(unlikely(copy_from_user(&tmp, arg, sizeof tmp)))
+		return -EFAULT;
+	if(unlikely(!tmp.handle))
+		return -EINVAL;
+	gb.handle = tmp.handle;
+	gb.status = tmp.status;
+	gb.act = tmp.buffer_actual;
+	gb.iso_count = tmp.packet_count;
+	gb.err_count = tmp.error_count;
+	gb.buf = NULL;
+	gb.iso = (const struct usb_vhci_ioc_iso_packet_giveback __user *)(unsigned long)tmp.iso_packets;
+	gb.fixed_offset = tmp.buffer_offset;
+	gb.iov = NULL;
+
+	down_read(&ifcp->fixed_sem);
+	if(unlikely(tmp.buffer_index >= ifcp->fixed_count))
+		ret = -EINVAL;
+	else
+	{
+		gb.fixed = &ifcp->fixed[tmp.buffer_index];
+		ret = ioc_giveback_common(vhc, &gb);
+	}
+	up_read(&ifcp->fixed_sem);
+	return ret;
+}
+
+// called in ioc_giveback_iov{,32} only
+static int ioc_giveback_iov_common(struct usb_vhci_hcd *vhc, struct vhci_giveback_desc *gb, const void __user *user_iov, int iov_count, int compat)
+{
+	struct vhci_ifc_priv *ifcp = vhcihcd_to_ifcp(vhc);
+	struct iovec *iov;
+	int ret;
+
+	if(unlikely(!gb->handle || iov_count < 0 || iov_count > USB_VHCI_IOV_MAX))
+		return -EINVAL;
+	iov = get_bounce(ifcp, iov_count * sizeof *iov);
+	if(unlikely(!iov))
+		return -ENOMEM;
+#ifdef CONFIG_COMPAT
+	if(compat)
+		ret = import_iov32(iov, user_iov, iov_count);
+	else
+#endif
+		ret = import_iov(iov, user_iov, iov_count);
+	if(likely(!ret))
+	{
+		gb->buf = NULL;
+		gb->fixed = NULL;
+		gb->iov = iov;
+		gb->iov_count = iov_count;
+		ret = ioc_giveback_common(vhc, gb);
+	}
+	put_bounce(ifcp, iov, iov_count * sizeof *iov);
+	return ret;
+}
+
+// called in device_ioctl only
+static int ioc_giveback_iov(struct usb_vhci_hcd *vhc, const struct usb_vhci_ioc_giveback_iov __user *arg)
+{
+	struct usb_vhci_ioc_giveback_iov tmp;
+	struct vhci_giveback_desc gb;
+
+#ifdef DEBUG
+	if(debug_output) dev_dbg(vhcihcd_to_dev(vhc), "cmd=USB_VHCI_HCD_IOCGIVEBACK_IOV\n");
+#endif
+
+	if(unlikely(copy_from_user(&tmp, arg, sizeof tmp)))
+		return -EFAULT;
+	gb.handle = tmp.handle;
+	gb.status = tmp.status;
+	gb.act = tmp.buffer_actual;
+	gb.iso_count = tmp.packet_count;
+	gb.err_count = tmp.error_count;
+	gb.iso = tmp.iso_packets;
+	return ioc_giveback_iov_common(vhc, &gb, tmp.iov, tmp.iov_count, 0);
+}
+
+// Reads *count giveback descriptors (at most USB_VHCI_GIVEBACK_BATCH_MAX) from user space and
+// gives back the urbs. The results are written to user_result, if it isn't NULL. *count receives
+// the number of entries which were processed.
+// called in ioc_giveback_batch and ioc_giveback_fetch only
+static int giveback_batch(struct usb_vhci_hcd *vhc, const struct usb_vhci_ioc_giveback __user *user_gb, __s32 __user *user_result, int *count)
+{
+	struct usb_vhci_ioc_giveback tmp;
+	struct vhci_giveback_desc *gb;
+	int i, n = *count, ret = 0;
+
+	if(n > USB_VHCI_GIVEBACK_BATCH_MAX)
+		n = USB_VHCI_GIVEBACK_BATCH_MAX;
+	if(unlikely(user_result && !access_ok(VERIFY_WRITE, user_result, n * sizeof *user_result)))
+		return -EFAULT;
+
+	gb = get_bounce(vhcihcd_to_ifcp(vhc), n * sizeof *gb);
+	if(unlikely(!gb))
+		return -ENOMEM;
+
+	for(i = 0; i < n; i++)
+	{
+		if(unlikely(copy_from_user(&tmp, &user_gb[i], sizeof tmp)))
+		{
+			ret = -EFAULT;
+			goto end;
+		}
+		if(unlikely(!tmp.handle))
+		{
+			ret = -EINVAL;
+			goto end;
+		}
+		gb[i].handle = tmp.handle;
+		gb[i].status = tmp.status;
+		gb[i].act = tmp.buffer_actual;
+		gb[i].iso_count = tmp.packet_count;
+		gb[i].err_count = tmp.error_count;
+		gb[i].buf = tmp.buffer;
+		gb[i].iso = tmp.iso_packets;
+		gb[i].fixed = NULL;
+		gb[i].iov = NULL;
+	}
+
+	ioc_giveback_batch_common(vhc, gb, n, 0);
+
+	if(user_result)
+	{
+		for(i = 0; i < n; i++)
+			__put_user(gb[i].result, &user_result[i]);
+	}
+	*count = n;
+
+end:
+	put_bounce(vhcihcd_to_ifcp(vhc), gb, n * sizeof *gb);
+	return ret;
+}
+
+// called in device_ioctl only
+static int ioc_giveback_batch(struct usb_vhci_hcd *vhc, struct usb_vhci_ioc_giveback_batch __user *arg)
+{
+	const struct usb_vhci_ioc_giveback __user *user_gb;
+	__s32 __user *user_result;
+	s32 count;
+	int n, ret;
+
+	__get_user(user_gb, &arg->giveback);
+	__get_user(user_result, &arg->result);
+	__get_user(count, &arg->count);
+
+#ifdef DEBUG
+	if(debug_output) dev_dbg(vhcihcd_to_dev(vhc), "cmd=USB_VHCI_HCD_IOCGIVEBACK_BATCH [count=%d]\n", (int)count);
+#endif
+
+	if(unlikely(count <= 0 || !user_gb || !user_result))
+		return -EINVAL;
+	n = count;
+	ret = giveback_batch(vhc, user_gb, user_result, &n);
+	if(likely(!ret))
+		__put_user(n, &arg->count);
+	return ret;
+}
+
+// called in device_ioctl only
+static int ioc_giveback_fetch(struct usb_vhci_hcd *vhc, struct usb_vhci_ioc_giveback_fetch __user *arg)
+{
+	const struct usb_vhci_ioc_giveback __user *user_gb;
+	__s32 __user *user_result;
+	struct usb_vhci_ioc_work __user *user_work;
+	s32 count, work_count;
+	s16 timeout;
+	int n, ret;
+
+	__get_user(user_gb, &arg->giveback);
+	__get_user(user_result, &arg->result);
+	__get_user(count, &arg->count);
+	__get_user(user_work, &arg->work);
+	__get_user(work_count, &arg->work_count);
+	__get_user(timeout, &arg->timeout);
+
+#ifdef DEBUG
+	// Floods the logs
+	//if(debug_output) dev_dbg(vhcihcd_to_dev(vhc), "cmd=USB_VHCI_HCD_IOCGIVEBACK_FETCH [count=%d]\n", (int)count);
+#endif
+
+	n = 0;
+	if(count > 0)
+	{
+		if(unlikely(!user_gb))
+			return -EINVAL;
+		n = count;
+		ret = giveback_batch(vhc, user_gb, user_result, &n);
+		if(unlikely(ret))
+			return ret;
+	}
+	__put_user(n, &arg->count);
+
+	return ioc_fetch_work_batch_common(vhc, user_work, work_count, timeout, &arg->work_count);
+}
+
+// Pins the urb, so that it can be accessed without holding the lock. A pinned urb can't be given
+// back by user space.
+// caller has lock
+static inline void urbp_pin(struct usb_vhci_urb_priv *urbp)
+{
+	urbp->pin_count++;
+}
+
+// If the urb was canceled and user space was already told so while it was pinned, it is given back
+// now.
+// caller has lock
+static inline void urbp_unpin(struct usb_vhci_hcd *vhc, struct usb_vhci_urb_priv *urbp)
+{
+	if(!--urbp->pin_count && unlikely(urbp->giveback_on_unpin))
+		ifc_giveback(vhc, urbp);
+}
+
+// Copies the iso packet table and tb_len bytes of the transfer buffer of a pinned urb to user
+// space. The data is scattered over the segments of iov. (The caller has checked the iso array
+// with access_ok and has checked that the segments can take tb_len bytes.)
+// called in ioc_fetch{,_work}_data_common only
+static int copy_urb_data(const struct urb *urb, const struct iovec *iov, int tb_len, struct usb_vhci_ioc_iso_packet_data __user *iso, int iso_count)
+{
+	const char *src = urb->transfer_buffer;
+	size_t n;
+	int i;
+
+	for(i = 0; i < iso_count; i++)
+	{
+		if(unlikely(__put_user(urb->iso_frame_desc[i].offset, &iso[i].offset) ||
+		            __put_user(urb->iso_frame_desc[i].length, &iso[i].packet_length)))
+			return -EFAULT;
+	}
+	for(i = 0; tb_len > 0; i++)
+	{
+		n = min_t(size_t, iov[i].iov_len, tb_len);
+		if(unlikely(copy_to_user(iov[i].iov_base, src, n)))
+			return -EFAULT;
+		src += n;
+		tb_len -= n;
+	}
+	return 0;
+}
+
+// Looks up a fetched urb whose data is going to be read.
+// Returns -ENOENT if the handle wasn't found and -ECANCELED if the urb was canceled.
+// caller has lock
+static int fetch_data_lookup(struct usb_vhci_hcd *vhc, u64 handle, struct usb_vhci_urb_priv **urbp_ret)
+{
+	struct usb_vhci_urb_priv *urbp;
+
+	if(unlikely(!(urbp = urbp_from_handle(vhc, handle))))
+		return -ENOENT;
+	if(unlikely(urbp->state != USB_VHCI_URB_STATE_FETCHED))
+	{
+		// we can give the urb back to its creator now, because the user space is informed about
+		// its cancelation (if another thread is still reading it, that thread will do it)
+		if(unlikely(urbp->pin_count))
+			urbp->giveback_on_unpin = 1;
+		else
+			ifc_giveback(vhc, urbp);
+		return -ECANCELED;
+	}
+	*urbp_ret = urbp;
+	return 0;
+}
+
+// called in ioc_fetch_data{,32} and ioc_fetch_data_iov{,32} only
+static int ioc_fetch_data_common(struct usb_vhci_hcd *vhc, u64 handle, const struct iovec *iov, int iov_count, struct usb_vhci_ioc_iso_packet_data __user *iso, int iso_count)
+{
+	struct usb_vhci_urb_priv *urbp;
+	unsigned long flags;
+	int tb_len, is_in, is_iso, ret = 0;
+
+	if(likely(iso_count > 0))
+	{
+		if(unlikely(!access_ok(VERIFY_WRITE, iso, iso_count * sizeof *iso)))
+			return -EFAULT;
+	}
+
+	spin_lock_irqsave(&vhc->lock, flags);
+	ret = fetch_data_lookup(vhc, handle, &urbp);
+	if(unlikely(ret))
+		goto end_unlock;
+
+	tb_len = urbp->urb->transfer_buffer_length;
+	if(unlikely(usb_pipecontrol(urbp->urb->pipe)))
+	{
+		const struct usb_ctrlrequest *cmd = (struct usb_ctrlrequest *)urbp->urb->setup_packet;
+		tb_len = le16_to_cpu(cmd->wLength);
+	}
+
+	is_in = is_urb_dir_in(urbp->urb);
+	is_iso = usb_pipeisoc(urbp->urb->pipe);
+
+	if(likely(is_iso))
+	{
+		if(unlikely(iso_count != urbp->urb->number_of_packets))
+		{
+			ret = -EINVAL;
+			goto end_unlock;
+		}
+		if(unlikely(iso_count && !iso))
+		{
+			ret = -EINVAL;
+			goto end_unlock;
+		}
+	}
+	else if(unlikely(is_in || !tb_len || !urbp->urb->transfer_buffer))
+	{
+		ret = -ENODATA;
+		goto end_unlock;
+	}
+
+	if(likely(!is_in && tb_len))
+	{
+		if(unlikely(iov_length(iov, iov_count) < tb_len))
+		{
+			ret = -EINVAL;
+			goto end_unlock;
+		}
+	}
+
+	// The urb stays alive while it is pinned, so we can release the spinlock and copy the data
+	// directly from the transfer buffer into the user-mode buffers.
+	urbp_pin(urbp);
+	spin_unlock_irqrestore(&vhc->lock, flags);
+
+	ret = copy_urb_data(urbp->urb, iov, is_in ? 0 : tb_len, iso, is_iso ? iso_count : 0);
+
+	spin_lock_irqsave(&vhc->lock, flags);
+	urbp_unpin(vhc, urbp);
+end_unlock:
+	spin_unlock_irqrestore(&vhc->lock, flags);
+	return ret;
+}
+
+// called in device_ioctl only
+static int ioc_fetch_data(struct usb_vhci_hcd *vhc, struct usb_vhci_ioc_urb_data __user *arg)
+{
+	struct usb_vhci_ioc_iso_packet_data __user *iso;
+	void __user *user_buf;
+	struct iovec iov;
+	u64 handle;
+	int user_len, iso_count;
+
+#ifdef DEBUG
+	if(debug_output) dev_dbg(vhcihcd_to_dev(vhc), "cmd=USB_VHCI_HCD_IOCFETCHDATA\n");
+#endif
+
+	if(sizeof(void *) > 4)
+		__get_user(handle, &arg->handle);
+	else
+	{
+		u32 handle1, handle2;
+		__get_user(handle1, (u32 __user *)&arg->handle);
+		__get_user(handle2, (u32 __user *)&arg->handle + 1);
+		*((u32 *)&handle) = handle1;
+		*((u32 *)&handle + 1) = handle2;
+	}
+	__get_user(user_len, &arg->buffer_length);
+	__get_user(iso_count, &arg->packet_count);
+	__get_user(user_buf, &arg->buffer);
+	__get_user(iso, &arg->iso_packets);
+	if(unlikely(!handle))
+		return -EINVAL;
+	iov.iov_base = user_buf;
+	iov.iov_len = user_buf && user_len > 0 ? user_len : 0;
+	return ioc_fetch_data_common(vhc, handle, &iov, 1, iso, iso_count);
+}
+
+// called in ioc_fetch_data_iov{,32} only
+static int ioc_fetch_data_iov_common(struct usb_vhci_hcd *vhc, u64 handle, const void __user *user_iov, int iov_count, struct usb_vhci_ioc_iso_packet_data __user *iso, int iso_count, int compat)
+{
+	struct vhci_ifc_priv *ifcp = vhcihcd_to_ifcp(vhc);
+	struct iovec *iov;
+	int ret;
+
+	if(unlikely(!handle || iov_count < 0 || iov_count > USB_VHCI_IOV_MAX))
+		return -EINVAL;
+	iov = get_bounce(ifcp, iov_count * sizeof *iov);
+	if(unlikely(!iov))
+		return -ENOMEM;
+#ifdef CONFIG_COMPAT
+	if(compat)
+		ret = import_iov32(iov, user_iov, iov_count);
+	else
+#endif
+		ret = import_iov(iov, user_iov, iov_count);
+	if(likely(!ret))
+		ret = ioc_fetch_data_common(vhc, handle, iov, iov_count, iso, iso_count);
+	put_bounce(ifcp, iov, iov_count * sizeof *iov);
+	return ret;
+}
+
+// called in device_ioctl only
+static int ioc_fetch_data_iov(struct usb_vhci_hcd *vhc, const struct usb_vhci_ioc_urb_data_iov __user *arg)
+{
+	struct usb_vhci_ioc_urb_data_iov tmp;
+
+#ifdef DEBUG
+	if(debug_output) dev_dbg(vhcihcd_to_dev(vhc), "cmd=USB_VHCI_HCD_IOCFETCHDATA_IOV\n");
+#endif
+
+	if(unlikely(copy_from_user(&tmp, arg, sizeof tmp)))
+		return -EFAULT;
+	return ioc_fetch_data_iov_common(vhc, tmp.handle, tmp.iov, tmp.iov_count, tmp.iso_packets, tmp.packet_count, 0);
+}
+
+// Reads from (write == 0) or writes to a file with a kernel buffer at offset (or at the file
+// position, if offset is negative).
+// Returns the number of bytes which were transferred.
+static ssize_t file_rw_kernel(struct file *file, void *buf, size_t len, loff_t offset, int write)
+{
+	mm_segment_t old_fs;
+	loff_t pos = offset, *ppos = offset < 0 ? &file->f_pos : &pos;
+	ssize_t ret;
+
+	old_fs = get_fs();
+	set_fs(KERNEL_DS);
+	if(write)
+		ret = vfs_write(file, (const char __user *)buf, len, ppos);
+	else
+		ret = vfs_read(file, (char __user *)buf, len, ppos);
+	set_fs(old_fs);
+	return ret;
+}
+
+// Gives back an IN urb whose data is read from a file directly into the transfer buffer.
+// called in device_ioctl only
+static int ioc_giveback_fd(struct usb_vhci_hcd *vhc, struct usb_vhci_ioc_giveback_fd __user *arg)
+{
+	struct usb_vhci_ioc_giveback_fd tmp;
+	struct usb_vhci_urb_priv *urbp;
+	struct file *file;
+	unsigned long flags;
+	ssize_t ret = 0;
+	int retval;
+
+	if(unlikely(copy_from_user(&tmp, arg, sizeof tmp)))
+		return -EFAULT;
+
+#ifdef DEBUG
+	if(debug_output) dev_dbg(vhcihcd_to_dev(vhc), "cmd=USB_VHCI_HCD_IOCGIVEBACK_FD [handle=0x%016llx fd=%d]\n", tmp.handle, (int)tmp.fd);
+#endif
+
+	if(unlikely(!tmp.handle || tmp.buffer_actual < 0))
+		return -EINVAL;
+	file = fget(tmp.fd);
+	if(unlikely(!file))
+		return -EBADF;
+	if(unlikely(!(file->f_mode & FMODE_READ)))
+	{
+		retval = -EBADF;
+		goto end;
+	}
+
+	// The urb stays in the "fetched" list and is only pinned while the data is read, because the
+	// read may block for a long time (pipes, sockets). So it can still be canceled meanwhile.
+	spin_lock_irqsave(&vhc->lock, flags);
+	retval = fetch_data_lookup(vhc, tmp.handle, &urbp);
+	if(unlikely(retval))
+		goto end_unlock;
+	if(unlikely(usb_pipeisoc(urbp->urb->pipe) || !is_urb_dir_in(urbp->urb)))
+		ret = -EINVAL;
+	else if(unlikely(tmp.buffer_actual > urbp->urb->transfer_buffer_length))
+		ret = -ENOBUFS;
+	else if(unlikely(tmp.buffer_actual && !urbp->urb->transfer_buffer))
+		ret = -EINVAL;
+	else
+		ret = 0;
+	if(likely(!ret && tmp.buffer_actual))
+	{
+		urbp_pin(urbp);
+		spin_unlock_irqrestore(&vhc->lock, flags);
+		ret = file_rw_kernel(file, urbp->urb->transfer_buffer, tmp.buffer_actual, tmp.offset, 0);
+		spin_lock_irqsave(&vhc->lock, flags);
+		// (this gives the urb back, if it was canceled and user space was told so meanwhile)
+		urbp_unpin(vhc, urbp);
+	}
+
+	// now the urb can be detached; like the other giveback ioctls, this consumes it even if
+	// something went wrong
+	retval = giveback_detach(vhc, tmp.handle, &urbp);
+	if(unlikely(!urbp))
+	{
+		if(retval == -ENOENT)
+			retval = -ECANCELED; // it was given back while we were reading
+		goto end_unlock;
+	}
+	if(likely(ret >= 0))
+	{
+		urbp->urb->actual_length = ret;
+		urbp->urb->error_count = tmp.error_count;
+		usb_vhci_maybe_set_status(urbp, tmp.status);
+	}
+	else
+	{
+		urbp->urb->actual_length = 0;
+		usb_vhci_maybe_set_status(urbp, -EPROTO);
+		retval = ret;
+	}
+	ifc_giveback(vhc, urbp);
+end_unlock:
+	spin_unlock_irqrestore(&vhc->lock, flags);
+	if(likely(ret >= 0 && (!retval || retval == -ECANCELED)))
+		__put_user((s32)ret, &arg->buffer_actual);
+end:
+	fput(file);
+	return retval;
+}
+
+// Writes the data of an OUT urb directly from the transfer buffer to a file.
+// called in device_ioctl only
+static int ioc_fetch_data_fd(struct usb_vhci_hcd *vhc, struct usb_vhci_ioc_fetch_data_fd __user *arg)
+{
+	struct usb_vhci_ioc_fetch_data_fd tmp;
+	struct usb_vhci_urb_priv *urbp;
+	struct file *file;
+	unsigned long flags;
+	ssize_t ret;
+	int tb_len;
+
+	if(unlikely(copy_from_user(&tmp, arg, sizeof tmp)))
+		return -EFAULT;
+
+#ifdef DEBUG
+	if(debug_output) dev_dbg(vhcihcd_to_dev(vhc), "cmd=USB_VHCI_HCD_IOCFETCHDATA_FD [handle=0x%016llx fd=%d]\n", tmp.handle, (int)tmp.fd);
+#endif
+
+	if(unlikely(!tmp.handle))
+		return -EINVAL;
+	file = fget(tmp.fd);
+	if(unlikely(!file))
+		return -EBADF;
+	if(unlikely(!(file->f_mode & FMODE_WRITE)))
+	{
+		ret = -EBADF;
+		goto end;
+	}
+
+	spin_lock_irqsave(&vhc->lock, flags);
+	ret = fetch_data_lookup(vhc, tmp.handle, &urbp);
+	if(unlikely(ret))
+		goto end_unlock;
+	tb_len = urbp->urb->transfer_buffer_length;
+	if(unlikely(usb_pipecontrol(urbp->urb->pipe)))
+	{
+		const struct usb_ctrlrequest *cmd = (struct usb_ctrlrequest *)urbp->urb->setup_packet;
+		tb_len = le16_to_cpu(cmd->wLength);
+	}
+	if(unlikely(usb_pipeisoc(urbp->urb->pipe)))
+	{
+		ret = -EOPNOTSUPP;
+		goto end_unlock;
+	}
+	if(unlikely(is_urb_dir_in(urbp->urb) || !tb_len || !urbp->urb->transfer_buffer))
+	{
+		ret = -ENODATA;
+		goto end_unlock;
+	}
+	urbp_pin(urbp);
+	spin_unlock_irqrestore(&vhc->lock, flags);
+
+	ret = file_rw_kernel(file, urbp->urb->transfer_buffer, tb_len, tmp.offset, 1);
+
+	spin_lock_irqsave(&vhc->lock, flags);
+	urbp_unpin(vhc, urbp);
+	spin_unlock_irqrestore(&vhc->lock, flags);
+
+	// (may fault, so not under the lock; arg may have been unmapped meanwhile)
+	if(likely(ret >= 0))
+		ret = put_user((s32)ret, &arg->written) ? -EFAULT : 0;
+	goto end;
+
+end_unlock:
+	spin_unlock_irqrestore(&vhc->lock, flags);
+end:
+	fput(file);
+	return ret;
+}
+
+// Checks if the iso packet table and the OUT payload of a freshly fetched urb fit into buffers of
+// buf_len bytes and iso_count iso packets.
+// Returns the number of payload bytes or -1 if there is nothing to inline or if it doesn't fit.
+// caller has lock
+static int inline_data_size(const struct usb_vhci_urb_priv *urbp, const struct usb_vhci_ioc_urb *urb, int buf_len, int iso_count)
+{
+	int tb_len = 0;
+
+	if(!is_urb_dir_in(urbp->urb))
+		tb_len = urb->buffer_length;
+	if(unlikely(tb_len > buf_len))
+		return -1;
+
+	if(usb_pipeisoc(urbp->urb->pipe))
+	{
+		if(unlikely(urb->packet_count > iso_count))
+			return -1;
+	}
+	else if(!tb_len)
+		return -1; // nothing to fetch
+	return tb_len;
+}
+
+// Copies the iso packet table and the OUT payload of a freshly fetched urb into the given buffers,
+// if there is something to copy and if all of it fits.
+// Returns the number of payload bytes which were copied or -1 if nothing was copied.
+// caller has lock
+static int inline_data_locked(const struct usb_vhci_urb_priv *urbp, const struct usb_vhci_ioc_urb *urb, void *buf, int buf_len, struct usb_vhci_ioc_iso_packet_data *iso, int iso_count)
+{
+	int i, tb_len;
+
+	tb_len = inline_data_size(urbp, urb, buf_len, iso_count);
+	if(tb_len < 0)
+		return -1;
+	if(usb_pipeisoc(urbp->urb->pipe))
+	{
+		for(i = 0; i < urb->packet_count; i++)
+		{
+			iso[i].offset = urbp->urb->iso_frame_desc[i].offset;
+			iso[i].packet_length = urbp->urb->iso_frame_desc[i].length;
+		}
+	}
+	if(tb_len)
+		memcpy(buf, urbp->urb->transfer_buffer, tb_len);
+	return tb_len;
+}
+
+// Works like ioc_fetch_work, but in addition copies the OUT payload into user_buf and the iso
+// packet table into iso, if they fit. In this case USB_VHCI_WORK_DATA_INLINED is written to
+// *flags_ret and the user doesn't need to call USB_VHCI_HCD_IOCFETCHDATA for this urb.
+// called in ioc_fetch_work_data{,32} only
+static int ioc_fetch_work_data_common(struct usb_vhci_hcd *vhc, struct usb_vhci_ioc_work __user *arg, s16 timeout, void __user *user_buf, int user_len, struct usb_vhci_ioc_iso_packet_data __user *iso, int iso_count, __u8 __user *flags_ret)
+{
+	struct usb_vhci_ioc_work work;
+	struct usb_vhci_urb_priv *urbp;
+	struct iovec iov;
+	unsigned long flags;
+	u8 work_flags = 0;
+	int ret, more, inlined = -1;
+
+	if(!user_buf || user_len < 0)
+		user_len = 0;
+	if(user_len > USB_VHCI_WORK_DATA_MAX_BUFFER)
+		user_len = USB_VHCI_WORK_DATA_MAX_BUFFER;
+	if(!iso || iso_count < 0)
+		iso_count = 0;
+	if(iso_count > USB_VHCI_WORK_DATA_MAX_PACKETS)
+		iso_count = USB_VHCI_WORK_DATA_MAX_PACKETS;
+	if(iso_count && !access_ok(VERIFY_WRITE, iso, iso_count * sizeof *iso))
+		iso_count = 0;
+
+	ret = wait_for_work(vhc, timeout);
+	if(ret)
+		return ret;
+
+	spin_lock_irqsave(&vhc->lock, flags);
+	ret = fetch_work_locked(vhc, &work, &urbp);
+	if(!ret && urbp)
+	{
+		inlined = inline_data_size(urbp, &work.work.urb, user_len, iso_count);
+		if(inlined >= 0)
+			urbp_pin(urbp);
+	}
+	more = drain_end(vhcihcd_to_ifcp(vhc), vhc);
+	spin_unlock_irqrestore(&vhc->lock, flags);
+	if(more)
+		pass_on_work(vhcihcd_to_ifcp(vhc));
+	if(ret)
+		return ret;
+
+	// the urb is pinned, so we can copy the data directly from the transfer buffer
+	// (if this fails, the urb is reported without data, so the user can still use
+	// USB_VHCI_HCD_IOCFETCHDATA)
+	if(inlined >= 0)
+	{
+		iov.iov_base = user_buf;
+		iov.iov_len = inlined;
+		if(likely(!copy_urb_data(urbp->urb, &iov, inlined, iso, work.work.urb.packet_count)))
+			work_flags = USB_VHCI_WORK_DATA_INLINED;
+		spin_lock_irqsave(&vhc->lock, flags);
+		urbp_unpin(vhc, urbp);
+		spin_unlock_irqrestore(&vhc->lock, flags);
+	}
+#ifdef DEBUG
+	if(debug_output && work_flags) dev_dbg(vhcihcd_to_dev(vhc), "cmd=USB_VHCI_HCD_IOCFETCHWORK_DATA [inlined %d bytes]\n", inlined);
+#endif
+	ret = put_work(arg, &work);
+	__put_user(work_flags, flags_ret);
+	return ret;
+}
+
+// called in device_ioctl only
+static int ioc_fetch_work_data(struct usb_vhci_hcd *vhc, struct usb_vhci_ioc_work_data __user *arg)
+{
+	struct usb_vhci_ioc_iso_packet_data __user *iso;
+	void __user *user_buf;
+	int user_len, iso_count;
+	s16 timeout;
+
+	__get_user(timeout, &arg->work.timeout);
+	__get_user(user_buf, &arg->buffer);
+	__get_user(user_len, &arg->buffer_length);
+	__get_user(iso, &arg->iso_packets);
+	__get_user(iso_count, &arg->packet_count);
+	return ioc_fetch_work_data_common(vhc, &arg->work, timeout, user_buf, user_len, iso, iso_count, &arg->flags);
+}
+
+
+// kernel side of the mmap'd rings (see USB_VHCI_HCD_IOCSETUP_RINGS)
+struct vhci_rings
+{
+	struct usb_vhci_hcd *vhc;
+	struct tasklet_struct tasklet;    // fills the work ring
+	struct mutex giveback_mutex;      // serializes the doorbells
+	unsigned long mem;
+	unsigned int order;
+	u32 size;
+	struct usb_vhci_ring *work_hdr, *giveback_hdr;
+	struct usb_vhci_ioc_work *work;
+	struct usb_vhci_ioc_ring_giveback *giveback;
+	u32 work_mask, giveback_mask;
+	u32 work_head;                    // our copy of work_hdr->head (user space may scribble on it)
+	u32 giveback_tail;                // our copy of giveback_hdr->tail
+	char *data;                       // data slots of the work ring entries (if data_size != 0)
+	u32 data_size;
+#ifndef NO_USE_MM
+	struct mm_struct *mm;             // address space the completion ring refers to (we hold
+	                                  // mm_count, but not mm_users)
+	struct work_struct drain_work;    // processes the completion ring when work gets posted
+#endif
+	struct vhci_giveback_desc gb[USB_VHCI_GIVEBACK_BATCH_MAX]; // caller of ring_drain has giveback_mutex
+};
+
+// Copies the iso packets and the OUT payload of a freshly fetched urb into the data slot of the
+// work ring entry i, if they fit.
+// caller has vhc->lock and has irq disabled
+static void ring_inline_locked(struct vhci_rings *rings, u32 i, const struct usb_vhci_ioc_work *work, const struct usb_vhci_urb_priv *urbp)
+{
+	struct usb_vhci_ring_data *d;
+	int space, iso_bytes, inlined = -1;
+
+	d = (struct usb_vhci_ring_data *)(rings->data + (i & rings->work_mask) * rings->data_size);
+	space = rings->data_size - sizeof *d;
+	if(urbp)
+	{
+		// the iso packets come first, the payload follows
+		iso_bytes = work->work.urb.packet_count * sizeof(struct usb_vhci_ioc_iso_packet_data);
+		if(iso_bytes <= space)
+			inlined = inline_data_locked(urbp, &work->work.urb,
+			                             (char *)(d + 1) + iso_bytes, space - iso_bytes,
+			                             (struct usb_vhci_ioc_iso_packet_data *)(d + 1),
+			                             work->work.urb.packet_count);
+	}
+	d->length = inlined >= 0 ? inlined : 0;
+	d->flags = inlined >= 0 ? USB_VHCI_WORK_DATA_INLINED : 0;
+}
+
+// Moves as much work as fits into the work ring.
+// Returns non-zero if something was added.
+// caller has vhc->lock and has irq disabled
+static int ring_fill_locked(struct vhci_rings *rings)
+{
+	struct usb_vhci_ioc_work work;
+	struct usb_vhci_urb_priv *urbp;
+	u32 head = rings->work_head, tail, rflags;
+
+	tail = ACCESS_ONCE(rings->work_hdr->tail);
+	// the entries must not be written before we have seen that user space is done with them
+	smp_mb();
+	while(head - tail <= rings->work_mask)
+	{
+		// (built on the stack, because user space may scribble on the ring while we read it)
+		if(fetch_work_locked(rings->vhc, &work, &urbp))
+			break;
+		if(rings->data_size)
+			ring_inline_locked(rings, head, &work, urbp);
+		rings->work[head & rings->work_mask] = work;
+		head++;
+	}
+
+	rflags = ACCESS_ONCE(rings->work_hdr->flags) & ~USB_VHCI_RING_NEED_DOORBELL;
+	if(head - tail > rings->work_mask)
+		rflags |= USB_VHCI_RING_NEED_DOORBELL;
+	ACCESS_ONCE(rings->work_hdr->flags) = rflags;
+
+	if(head == rings->work_head)
+		return 0;
+	// the entries have to be visible before the new head
+	smp_wmb();
+	ACCESS_ONCE(rings->work_hdr->head) = head;
+	rings->work_head = head;
+	return 1;
+}
+
+static void ring_tasklet(unsigned long data)
+{
+	struct vhci_rings *rings = (struct vhci_rings *)data;
+	unsigned long flags;
+	int filled;
+
+	spin_lock_irqsave(&rings->vhc->lock, flags);
+	filled = ring_fill_locked(rings);
+	spin_unlock_irqrestore(&rings->vhc->lock, flags);
+	if(filled)
+		wake_up_interruptible(&vhcihcd_to_ifcp(rings->vhc)->work_event);
+}
+
+// caller has ifcp->ring_lock
+static void ring_schedule(struct vhci_rings *rings)
+{
+	tasklet_schedule(&rings->tasklet);
+#ifndef NO_USE_MM
+	// Completions which user space has put into the ring meanwhile are processed now, so that a
+	// busy consumer never has to ring the doorbell. (giveback_tail is read without the
+	// giveback_mutex; if we miss a change, the next event or the doorbell catches it.)
+	if(ACCESS_ONCE(rings->giveback_hdr->head) != ACCESS_ONCE(rings->giveback_tail))
+		schedule_work(&rings->drain_work);
+#endif
+}
+
+// Returns non-zero if the work ring contains entries which weren't consumed by user space yet.
+static inline int ring_has_work(struct vhci_rings *rings)
+{
+	return ACCESS_ONCE(rings->work_hdr->head) != ACCESS_ONCE(rings->work_hdr->tail);
+}
+
+// Gives back the urbs which user space has put into the completion ring.
+// caller has rings->giveback_mutex
+static int ring_drain(struct vhci_rings *rings)
+{
+	const struct usb_vhci_ioc_ring_giveback *e;
+	struct vhci_giveback_desc *gb;
+	u32 tail = rings->giveback_tail, head;
+	int i, n;
+
+	head = ACCESS_ONCE(rings->giveback_hdr->head);
+	// the entries must not be read before the head
+	smp_rmb();
+	if(unlikely(head - tail > rings->giveback_mask + 1))
+		return -EINVAL;
+
+	while(tail != head)
+	{
+		for(n = 0; tail != head && n < USB_VHCI_GIVEBACK_BATCH_MAX; tail++)
+		{
+			e = &rings->giveback[tail & rings->giveback_mask];
+			gb = &rings->gb[n];
+			gb->handle = e->handle;
+			if(unlikely(!gb->handle))
+				continue;
+			gb->status = e->status;
+			gb->act = e->buffer_actual;
+			gb->iso_count = e->packet_count;
+			gb->err_count = e->error_count;
+			gb->buf = (const void __user *)(unsigned long)e->buffer;
+			gb->iso = (const struct usb_vhci_ioc_iso_packet_giveback __user *)(unsigned long)e->iso_packets;
+			gb->fixed = NULL;
+			gb->iov = NULL;
+			n++;
+		}
+
+		if(likely(n))
+			ioc_giveback_batch_common(rings->vhc, rings->gb, n, 0);
+#ifdef DEBUG
+		for(i = 0; i < n; i++)
+			if(debug_output && rings->gb[i].result && rings->gb[i].result != -ECANCELED)
+				dev_dbg(vhcihcd_to_dev(rings->vhc), "RING_DOORBELL: giveback of handle 0x%016llx failed with %d\n", rings->gb[i].handle, rings->gb[i].result);
+#endif
+
+		// user space may reuse the entries after we have updated the tail
+		smp_mb();
+		ACCESS_ONCE(rings->giveback_hdr->tail) = tail;
+		rings->giveback_tail = tail;
+	}
+	return 0;
+}
+
+#ifndef NO_USE_MM
+// Processes the completion ring in the address space of the process which set up the rings, and
+// refills the work ring.
+static void ring_drain_work(struct work_struct *work)
+{
+	struct vhci_rings *rings = container_of(work, struct vhci_rings, drain_work);
+	struct usb_vhci_hcd *vhc = rings->vhc;
+	unsigned long flags;
+	int ret, filled;
+
+	// the address space may be gone already
+	if(unlikely(!atomic_inc_not_zero(&rings->mm->mm_users)))
+		return;
+	use_mm(rings->mm);
+	mutex_lock(&rings->giveback_mutex);
+	ret = ring_drain(rings);
+	mutex_unlock(&rings->giveback_mutex);
+	unuse_mm(rings->mm);
+	mmput(rings->mm);
+#ifdef DEBUG
+	if(debug_output && ret) dev_dbg(vhcihcd_to_dev(vhc), "ring_drain_work: completion ring is corrupt\n");
+#endif
+	run_revokes(vhcihcd_to_ifcp(vhc), vhc);
+
+	spin_lock_irqsave(&vhc->lock, flags);
+	filled = ring_fill_locked(rings);
+	spin_unlock_irqrestore(&vhc->lock, flags);
+	if(filled)
+		wake_up_interruptible(&vhcihcd_to_ifcp(vhc)->work_event);
+}
+#endif
+
+// Disables the rings. After this function returns, neither the tasklet nor the drain work runs
+// anymore.
+// called in device_release only
+static void free_rings(struct vhci_ifc_priv *ifcp)
+{
+	struct vhci_rings *rings;
+	unsigned long flags, i;
+
+	spin_lock_irqsave(&ifcp->ring_lock, flags);
+	rings = ifcp->rings;
+	ifcp->rings = NULL;
+	spin_unlock_irqrestore(&ifcp->ring_lock, flags);
+	if(!rings)
+		return;
+
+	tasklet_kill(&rings->tasklet);
+#ifndef NO_USE_MM
+	cancel_work_sync(&rings->drain_work);
+	mmdrop(rings->mm);
+#endif
+	for(i = 0; i < rings->size; i += PAGE_SIZE)
+		ClearPageReserved(virt_to_page((void *)(rings->mem + i)));
+	free_pages(rings->mem, rings->order);
+	kfree(rings);
+}
+
+// called in device_ioctl only
+static int ioc_setup_rings(struct usb_vhci_hcd *vhc, struct usb_vhci_ioc_setup_rings __user *arg)
+{
+	struct vhci_ifc_priv *ifcp = vhcihcd_to_ifcp(vhc);
+	struct vhci_rings *rings;
+	u32 work_entries, giveback_entries, data_size, work_off, giveback_off, data_off, size, n;
+	unsigned long flags, i;
+
+	__get_user(work_entries, &arg->work_entries);
+	__get_user(giveback_entries, &arg->giveback_entries);
+	__get_user(data_size, &arg->data_size);
+
+#ifdef DEBUG
+	if(debug_output) dev_dbg(vhcihcd_to_dev(vhc), "cmd=USB_VHCI_HCD_IOCSETUP_RINGS [work_entries=%u giveback_entries=%u data_size=%u]\n", work_entries, giveback_entries, data_size);
+#endif
+
+	if(unlikely(!work_entries || work_entries > USB_VHCI_RING_MAX_ENTRIES ||
+	            !giveback_entries || giveback_entries > USB_VHCI_RING_MAX_ENTRIES ||
+	            data_size > USB_VHCI_RING_MAX_DATA || (data_size && data_size <= sizeof(struct usb_vhci_ring_data))))
+		return -EINVAL;
+	if(unlikely(ifcp->rings))
+		return -EBUSY;
+	data_size = ALIGN(data_size, 8);
+
+	// round up to the next power of two
+	for(n = 1; n < work_entries; n <<= 1);
+	work_entries = n;
+	for(n = 1; n < giveback_entries; n <<= 1);
+	giveback_entries = n;
+
+	// every ring header gets a cache line of its own
+	work_off = 2 * L1_CACHE_BYTES;
+	giveback_off = ALIGN(work_off + work_entries * sizeof(struct usb_vhci_ioc_work), L1_CACHE_BYTES);
+	data_off = ALIGN(giveback_off + giveback_entries * sizeof(struct usb_vhci_ioc_ring_giveback), L1_CACHE_BYTES);
+	size = PAGE_ALIGN(data_off + work_entries * data_size);
+	if(unlikely(get_order(size) >= MAX_ORDER))
+		return -EINVAL;
+
+	rings = kzalloc(sizeof *rings, GFP_KERNEL);
+	if(unlikely(!rings))
+		return -ENOMEM;
+	rings->order = get_order(size);
+	rings->mem = __get_free_pages(GFP_KERNEL | __GFP_ZERO, rings->order);
+	if(unlikely(!rings->mem))
+	{
+		kfree(rings);
+		return -ENOMEM;
+	}
+	// the pages get mapped into user space by device_mmap
+	for(i = 0; i < size; i += PAGE_SIZE)
+		SetPageReserved(virt_to_page((void *)(rings->mem + i)));
+
+	rings->vhc = vhc;
+	rings->size = size;
+	rings->work_hdr = (struct usb_vhci_ring *)rings->mem;
+	rings->giveback_hdr = (struct usb_vhci_ring *)(rings->mem + L1_CACHE_BYTES);
+	rings->work = (struct usb_vhci_ioc_work *)(rings->mem + work_off);
+	rings->giveback = (struct usb_vhci_ioc_ring_giveback *)(rings->mem + giveback_off);
+	rings->data = (char *)(rings->mem + data_off);
+	rings->data_size = data_size;
+	rings->work_mask = rings->work_hdr->mask = work_entries - 1;
+	rings->giveback_mask = rings->giveback_hdr->mask = giveback_entries - 1;
+	tasklet_init(&rings->tasklet, ring_tasklet, (unsigned long)rings);
+	mutex_init(&rings->giveback_mutex);
+#ifndef NO_USE_MM
+	rings->mm = current->mm;
+	atomic_inc(&rings->mm->mm_count);
+	INIT_WORK(&rings->drain_work, ring_drain_work);
+#endif
+
+	spin_lock_irqsave(&ifcp->ring_lock, flags);
+	if(unlikely(ifcp->rings))
+	{
+		spin_unlock_irqrestore(&ifcp->ring_lock, flags);
+#ifndef NO_USE_MM
+		mmdrop(rings->mm);
+#endif
+		for(i = 0; i < size; i += PAGE_SIZE)
+			ClearPageReserved(virt_to_page((void *)(rings->mem + i)));
+		free_pages(rings->mem, rings->order);
+		kfree(rings);
+		return -EBUSY;
+	}
+	ifcp->rings = rings;
+	// there may be work already
+	ring_schedule(rings);
+	spin_unlock_irqrestore(&ifcp->ring_lock, flags);
+
+	__put_user(work_entries, &arg->work_entries);
+	__put_user(giveback_entries, &arg->giveback_entries);
+	__put_user(0, &arg->work_ring);
+	__put_user(L1_CACHE_BYTES, &arg->giveback_ring);
+	__put_user(work_off, &arg->work_offset);
+	__put_user(giveback_off, &arg->giveback_offset);
+	__put_user(size, &arg->size);
+	__put_user(data_size, &arg->data_size);
+	__put_user(data_off, &arg->data_offset);
+	return 0;
+}
 
-	// remove urb from list before we release the spinlock
-	list_del(&urbp->urbp_list);
+// Gives back the urbs from the completion ring, refills the work ring and optionally waits until
+// the work ring isn't empty. (A timeout of zero only checks, a negative timeout waits forever.)
+// called in device_ioctl only
+static int ioc_ring_doorbell(struct usb_vhci_hcd *vhc, const struct usb_vhci_ioc_ring_doorbell __user *arg)
+{
+	struct vhci_ifc_priv *ifcp = vhcihcd_to_ifcp(vhc);
+	struct vhci_rings *rings = ifcp->rings;
+	unsigned long flags;
+	long wret;
+	s16 timeout;
+	int ret;
+
+	__get_user(timeout, &arg->timeout);
+	if(unlikely(!rings))
+		return -ENXIO;
 
+	mutex_lock(&rings->giveback_mutex);
+	ret = ring_drain(rings);
+	mutex_unlock(&rings->giveback_mutex);
+	if(unlikely(ret))
+		return ret;
+
+	spin_lock_irqsave(&vhc->lock, flags);
+	ring_fill_locked(rings);
 	spin_unlock_irqrestore(&vhc->lock, flags);
 
-	// usb_vhci_urb_giveback() (called below) will fail if we don't re-initialize
-	// the list entry, because it calls list_del(), too!
-	INIT_LIST_HEAD(&urbp->urbp_list);
+	if(ring_has_work(rings))
+		return 0;
+	if(!timeout)
+		return -ETIMEDOUT;
+	if(timeout > 1000)
+		timeout = 1000;
+	if(timeout > 0)
+		wret = wait_event_interruptible_timeout(ifcp->work_event, ring_has_work(rings), msecs_to_jiffies(timeout));
+	else
+		wret = wait_event_interruptible(ifcp->work_event, ring_has_work(rings));
+	if(unlikely(wret < 0))
+	{
+		if(likely(wret == -ERESTARTSYS))
+			return -EINTR;
+		return wret;
+	}
+	else if(!wret)
+		return -ETIMEDOUT;
+	return 0;
+}
+
+#ifndef NO_ZAP_VMA_PTES
+static void data_window_vm_open(struct vm_area_struct *vma)
+{
+	struct vhci_data_window *w = vma->vm_private_data;
 
-	is_in = is_urb_dir_in(urbp->urb);
-	is_iso = usb_pipeisoc(urbp->urb->pipe);
+	mutex_lock(&w->mutex);
+	w->vma_count++;
+	// the vma was split or copied, so we don't know anymore which vmas cover the window
+	w->vma = NULL;
+	mutex_unlock(&w->mutex);
+}
 
-	if(likely(is_iso))
+static void data_window_vm_close(struct vm_area_struct *vma)
+{
+	struct vhci_data_window *w = vma->vm_private_data;
+	struct mm_struct *mm = NULL;
+
+	mutex_lock(&w->mutex);
+	if(w->vma == vma)
+		w->vma = NULL;
+	if(!--w->vma_count)
 	{
-		if(unlikely(is_in && act != urbp->urb->transfer_buffer_length))
-		{
-#ifdef DEBUG
-			if(debug_output) dev_dbg(dev, "GIVEBACK(ISO): invalid: buffer_actual != buffer_length\n");
-#endif
-			retval = -ENOBUFS;
-			goto done_with_errors;
-		}
-		if(unlikely(iso_count != urbp->urb->number_of_packets))
-		{
-#ifdef DEBUG
-			if(debug_output) dev_dbg(dev, "GIVEBACK(ISO): invalid: number_of_packets missmatch\n");
-#endif
-			retval = -EINVAL;
-			goto done_with_errors;
-		}
-		if(unlikely(iso_count && !iso))
-		{
-#ifdef DEBUG
-			if(debug_output) dev_dbg(dev, "GIVEBACK(ISO): invalid: iso_packets must not be zero\n");
-#endif
-			retval = -EINVAL;
-			goto done_with_errors;
-		}
-		if(likely(iso_count))
-		{
-			if(!access_ok(VERIFY_READ, (void *)iso, iso_count * sizeof(struct usb_vhci_ioc_iso_packet_giveback)))
-			{
-				retval = -EFAULT;
-				goto done_with_errors;
-			}
-		}
+		spin_lock(&w->lock);
+		mm = w->mm;
+		w->mm = NULL;
+		spin_unlock(&w->lock);
 	}
-	else if(unlikely(act > urbp->urb->transfer_buffer_length))
+	mutex_unlock(&w->mutex);
+	if(mm)
+		mmdrop(mm);
+}
+
+static const struct vm_operations_struct data_window_vm_ops =
+{
+	.open = data_window_vm_open,
+	.close = data_window_vm_close
+};
+
+// Sets up a vma for the data window. The pages are inserted by ioc_map_data.
+// called in device_mmap only
+static int data_window_mmap(struct vhci_ifc_priv *ifcp, struct vm_area_struct *vma)
+{
+	struct vhci_data_window *w = &ifcp->window;
+	unsigned long first = vma->vm_pgoff - VHCI_DATA_PGOFF;
+
+	if(unlikely(!(vma->vm_flags & VM_SHARED)))
+		return -EINVAL;
+	if(unlikely(vma->vm_flags & VM_WRITE))
+		return -EPERM;
+	if(unlikely(first + ((vma->vm_end - vma->vm_start) >> PAGE_SHIFT) > VHCI_DATA_WINDOW_PAGES))
+		return -EINVAL;
+
+	mutex_lock(&w->mutex);
+	if(unlikely(w->vma_count && w->mm != vma->vm_mm))
 	{
-#ifdef DEBUG
-		if(debug_output) dev_dbg(dev, "GIVEBACK: invalid: buffer_actual > buffer_length\n");
-#endif
-		retval = is_in ? -ENOBUFS : -EINVAL;
-		goto done_with_errors;
+		mutex_unlock(&w->mutex);
+		return -EBUSY;
 	}
-	if(is_in)
+	if(!w->vma_count++)
 	{
-		if(unlikely(act && !buf))
-		{
-#ifdef DEBUG
-			if(debug_output) dev_dbg(dev, "GIVEBACK: buf must not be zero\n");
-#endif
-			retval = -EINVAL;
-			goto done_with_errors;
-		}
-		if(unlikely(copy_from_user(urbp->urb->transfer_buffer, buf, act)))
-		{
-#ifdef DEBUG
-			if(debug_output) dev_dbg(dev, "GIVEBACK: copy_from_user(buf) failed\n");
-#endif
-			retval = -EFAULT;
-			goto done_with_errors;
-		}
+		atomic_inc(&vma->vm_mm->mm_count);
+		spin_lock(&w->lock);
+		w->mm = vma->vm_mm;
+		spin_unlock(&w->lock);
+		w->vma = vma;
 	}
-	else if(unlikely(buf))
+	else
+		w->vma = NULL;
+	mutex_unlock(&w->mutex);
+
+	vma->vm_flags &= ~VM_MAYWRITE;
+	vma->vm_flags |= VM_IO | VM_RESERVED | VM_PFNMAP | VM_DONTCOPY | VM_DONTEXPAND;
+	vma->vm_ops = &data_window_vm_ops;
+	vma->vm_private_data = w;
+	return 0;
+}
+
+// Returns the address space the window is mapped into with a reference on its users, or NULL.
+static struct mm_struct *data_window_get_mm(struct vhci_data_window *w)
+{
+	struct mm_struct *mm;
+
+	spin_lock(&w->lock);
+	mm = w->mm;
+	// the address space may be going away already
+	if(mm && !atomic_inc_not_zero(&mm->mm_users))
+		mm = NULL;
+	spin_unlock(&w->lock);
+	return mm;
+}
+
+// Maps the physical pages starting at pfn (or unmaps the pages, if pfn is zero) at the pages
+// [first, first + pages) of the window in every vma of mm which covers them.
+// caller has mm->mmap_sem (for writing) and w->mutex
+static int data_window_apply(struct vhci_data_window *w, struct mm_struct *mm, unsigned long first, unsigned long pages, unsigned long pfn)
+{
+	struct vm_area_struct *vma;
+	unsigned long vfirst, vlast, s, e, addr;
+	int ret = 0;
+
+	for(vma = w->vma ? w->vma : mm->mmap; vma; vma = w->vma ? NULL : vma->vm_next)
 	{
-#ifdef DEBUG
-		if(debug_output) dev_dbg(dev, "GIVEBACK: invalid: buf should be NULL\n");
-#endif
-		// no data expected, so buf should be NULL
-		retval = -EINVAL;
-		goto done_with_errors;
+		if(vma->vm_ops != &data_window_vm_ops || vma->vm_private_data != w)
+			continue;
+		vfirst = vma->vm_pgoff - VHCI_DATA_PGOFF;
+		vlast = vfirst + ((vma->vm_end - vma->vm_start) >> PAGE_SHIFT);
+		s = max(vfirst, first);
+		e = min(vlast, first + pages);
+		if(s >= e)
+			continue;
+		addr = vma->vm_start + ((s - vfirst) << PAGE_SHIFT);
+		// (reading an unused part of the window may have faulted in zero pages)
+		zap_vma_ptes(vma, addr, (e - s) << PAGE_SHIFT);
+		if(pfn && !ret)
+			ret = remap_pfn_range(vma, addr, pfn + (s - first), (e - s) << PAGE_SHIFT, vma->vm_page_prot);
 	}
-	if(likely(is_iso && iso_count))
+	return ret;
+}
+
+// Allocates pages contiguous pages of the window.
+// Returns the first page or -ENOSPC.
+// caller has w->mutex
+static long data_window_alloc(struct vhci_data_window *w, unsigned long pages)
+{
+	unsigned long first = 0, busy, i;
+
+	for(;;)
 	{
-		for(i = 0; i < iso_count; i++)
-		{
-			__get_user(urbp->urb->iso_frame_desc[i].status, &iso[i].status);
-			__get_user(urbp->urb->iso_frame_desc[i].actual_length, &iso[i].packet_actual);
-		}
+		first = find_next_zero_bit(w->used, VHCI_DATA_WINDOW_PAGES, first);
+		if(first + pages > VHCI_DATA_WINDOW_PAGES)
+			return -ENOSPC;
+		busy = find_next_bit(w->used, first + pages, first);
+		if(busy >= first + pages)
+			break;
+		first = busy + 1;
 	}
-	urbp->urb->actual_length = act;
-	urbp->urb->error_count = err_count;
+	for(i = first; i < first + pages; i++)
+		__set_bit(i, w->used);
+	return first;
+}
+
+// caller has w->mutex
+static void data_window_free(struct vhci_data_window *w, unsigned long first, unsigned long pages)
+{
+	unsigned long i;
+
+	for(i = first; i < first + pages; i++)
+		__clear_bit(i, w->used);
+}
+
+// Unmaps the data of the urbs which were marked by revoke_locked and gives back the urbs whose
+// giveback was deferred by ifc_giveback.
+// called without holding any locks
+static void run_revokes(struct vhci_ifc_priv *ifcp, struct usb_vhci_hcd *vhc)
+{
+	struct vhci_data_window *w = &ifcp->window;
+	unsigned long revoke[BITS_TO_LONGS(USB_VHCI_DATA_MAX_MAPS)];
+	struct usb_vhci_urb_priv *urbp, *tmp;
+	struct vhci_data_map *m;
+	struct mm_struct *mm;
+	unsigned long flags;
+	LIST_HEAD(done);
+	int i;
+
+	if(likely(!w->revoke_pending))
+		return;
+
+	mm = data_window_get_mm(w);
+	if(mm)
+		down_write(&mm->mmap_sem);
+	mutex_lock(&w->mutex);
 
-	// now we are done with this urb and it can return to its creator
-	usb_vhci_maybe_set_status(urbp, status);
 	spin_lock_irqsave(&vhc->lock, flags);
-	usb_vhci_urb_giveback(vhc, urbp);
+	w->revoke_pending = 0;
+	memcpy(revoke, w->revoke, sizeof revoke);
+	memset(w->revoke, 0, sizeof w->revoke);
 	spin_unlock_irqrestore(&vhc->lock, flags);
-#ifdef DEBUG
-	if(debug_output) dev_dbg(dev, "GIVEBACK: done\n");
-#endif
-	return retval;
 
-done_with_errors:
+	for(i = 0; i < USB_VHCI_DATA_MAX_MAPS; i++)
+	{
+		m = &w->map[i];
+		if(!test_bit(i, revoke) || !m->handle)
+			continue;
+		// (if the window was unmapped in the meantime, then there is nothing to zap)
+		if(mm && w->mm == mm)
+			data_window_apply(w, mm, m->first, m->pages, 0);
+		data_window_free(w, m->first, m->pages);
+		spin_lock_irqsave(&vhc->lock, flags);
+		urbp = usb_vhci_urbp_from_handle(vhc, m->handle);
+		if(likely(urbp))
+			urbp->data_mapped = 0;
+		spin_unlock_irqrestore(&vhc->lock, flags);
+		m->handle = 0;
+	}
+
+	mutex_unlock(&w->mutex);
+	if(mm)
+	{
+		up_write(&mm->mmap_sem);
+		mmput(mm);
+	}
+
 	spin_lock_irqsave(&vhc->lock, flags);
-	usb_vhci_urb_giveback(vhc, urbp);
+	list_for_each_entry_safe(urbp, tmp, &w->revoke_list, urbp_list)
+	{
+		if(likely(!urbp->data_mapped))
+			list_move_tail(&urbp->urbp_list, &done);
+	}
+	usb_vhci_urb_giveback_list(vhc, &done);
 	spin_unlock_irqrestore(&vhc->lock, flags);
-#ifdef DEBUG
-	if(debug_output) dev_dbg(dev, "GIVEBACK: done (with errors)\n");
-#endif
-	return retval;
 }
 
+// Maps the transfer buffer of a fetched OUT urb read-only into the data window. The mapping is
+// removed when the urb is given back or when its cancelation is fetched.
 // called in device_ioctl only
-static int ioc_giveback(struct usb_vhci_hcd *vhc, const struct usb_vhci_ioc_giveback __user *arg)
+static int ioc_map_data(struct usb_vhci_hcd *vhc, struct usb_vhci_ioc_map_data __user *arg)
 {
-	const struct usb_vhci_ioc_iso_packet_giveback __user *iso;
-	const void *handle;
-	const void __user *buf;
-	u64 handle64;
-	int status, act, iso_count, err_count;
-
-#ifdef DEBUG
-	if(debug_output) dev_dbg(vhcihcd_to_dev(vhc), "cmd=USB_VHCI_HCD_IOCGIVEBACK\n");
-#endif
+	struct vhci_ifc_priv *ifcp = vhcihcd_to_ifcp(vhc);
+	struct vhci_data_window *w = &ifcp->window;
+	struct mm_struct *mm = current->mm;
+	struct usb_vhci_urb_priv *urbp;
+	unsigned long flags, pages, pfn;
+	long first;
+	void *buf;
+	u64 handle;
+	int tb_len, i, ret = 0;
 
 	if(sizeof(void *) > 4)
-		__get_user(handle64, &arg->handle);
+		__get_user(handle, &arg->handle);
 	else
 	{
 		u32 handle1, handle2;
 		__get_user(handle1, (u32 __user *)&arg->handle);
 		__get_user(handle2, (u32 __user *)&arg->handle + 1);
-		*((u32 *)&handle64) = handle1;
-		*((u32 *)&handle64 + 1) = handle2;
-		if(handle64 >> 32)
-			return -EINVAL;
+		*((u32 *)&handle) = handle1;
+		*((u32 *)&handle + 1) = handle2;
 	}
-	__get_user(status, &arg->status);
-	__get_user(act, &arg->buffer_actual);
-	__get_user(iso_count, &arg->packet_count);
-	__get_user(err_count, &arg->error_count);
-	__get_user(buf, &arg->buffer);
-	__get_user(iso, &arg->iso_packets);
-	handle = (const void *)(unsigned long)handle64;
+
+#ifdef DEBUG
+	if(debug_output) dev_dbg(vhcihcd_to_dev(vhc), "cmd=USB_VHCI_HCD_IOCMAPDATA [handle=0x%016llx]\n", handle);
+#endif
+
 	if(unlikely(!handle))
 		return -EINVAL;
-	return ioc_giveback_common(vhc, handle, status, act, iso_count, err_count, buf, iso);
-}
-
-// called in ioc_fetch_data{,32} only
-static int ioc_fetch_data_common(struct usb_vhci_hcd *vhc, const void *handle, void __user *user_buf, int user_len, struct usb_vhci_ioc_iso_packet_data __user *iso, int iso_count)
-{
-	struct usb_vhci_urb_priv *urbp;
-	unsigned long flags;
-	int tb_len, is_in, is_iso, i, ret = -ENOMEM;
-	void *user_buf_tmp = NULL;
-	struct usb_vhci_ioc_iso_packet_data *iso_tmp = NULL;
+	if(unlikely(!mm))
+		return -ENXIO;
 
-	if(likely(user_len))
+	down_write(&mm->mmap_sem);
+	mutex_lock(&w->mutex);
+	if(unlikely(!w->vma_count || w->mm != mm))
 	{
-		user_buf_tmp = kmalloc(user_len, GFP_KERNEL);
-		if(unlikely(!user_buf_tmp))
-			goto end;
+		ret = -ENXIO;
+		goto end;
 	}
-	if(likely(iso_count))
+	for(i = 0; i < USB_VHCI_DATA_MAX_MAPS && w->map[i].handle; i++);
+	if(unlikely(i == USB_VHCI_DATA_MAX_MAPS))
 	{
-		iso_tmp = kmalloc(iso_count * sizeof *iso_tmp, GFP_KERNEL);
-		if(unlikely(!iso_tmp))
-			goto end;
+		ret = -ENOSPC;
+		goto end;
 	}
-	ret = 0;
 
 	spin_lock_irqsave(&vhc->lock, flags);
 	if(unlikely(!(urbp = urbp_from_handle(vhc, handle))))
 	{
-		// if not found, check the cancel{,ing} list
-		if(likely((urbp = urbp_from_handle_in_cancel(vhc, handle)) ||
-			(urbp = urbp_from_handle_in_canceling(vhc, handle))))
-		{
-			// we can give the urb back to its creator now, because the user space is informed about
-			// its cancelation
-			usb_vhci_urb_giveback(vhc, urbp);
-			ret = -ECANCELED;
-			goto end_unlock;
-		}
 		ret = -ENOENT;
 		goto end_unlock;
 	}
+	if(unlikely(urbp->state != USB_VHCI_URB_STATE_FETCHED))
+	{
+		ret = -ECANCELED;
+		goto end_unlock;
+	}
+	if(unlikely(urbp->data_mapped))
+	{
+		ret = -EBUSY;
+		goto end_unlock;
+	}
 
 	tb_len = urbp->urb->transfer_buffer_length;
 	if(unlikely(usb_pipecontrol(urbp->urb->pipe)))
@@ -752,142 +3116,238 @@ static int ioc_fetch_data_common(struct usb_vhci_hcd *vhc, const void *handle, v
 		const struct usb_ctrlrequest *cmd = (struct usb_ctrlrequest *)urbp->urb->setup_packet;
 		tb_len = le16_to_cpu(cmd->wLength);
 	}
-
-	is_in = is_urb_dir_in(urbp->urb);
-	is_iso = usb_pipeisoc(urbp->urb->pipe);
-
-	if(likely(is_iso))
+	buf = urbp->urb->transfer_buffer;
+	pages = tb_len >> PAGE_SHIFT;
+
+	// We can only map buffers from the linear mapping, which consist of whole pages. Otherwise
+	// user space would see parts of other objects, which share the first or the last page.
+	// (For control urbs only the wLength bytes are mapped, and they must not exceed the buffer.)
+	if(unlikely(is_urb_dir_in(urbp->urb) || tb_len <= 0 || !buf ||
+	            tb_len > urbp->urb->transfer_buffer_length ||
+	            offset_in_page(buf) || (tb_len & ~PAGE_MASK) ||
+	            !virt_addr_valid(buf) || !virt_addr_valid(buf + (pages << PAGE_SHIFT) - 1)))
 	{
-		if(unlikely(iso_count != urbp->urb->number_of_packets))
-		{
-			ret = -EINVAL;
-			goto end_unlock;
-		}
-		if(likely(iso_count))
-		{
-			if(unlikely(!iso))
-			{
-				ret = -EINVAL;
-				goto end_unlock;
-			}
-			for(i = 0; i < iso_count; i++)
-			{
-				iso_tmp[i].offset = urbp->urb->iso_frame_desc[i].offset;
-				iso_tmp[i].packet_length = urbp->urb->iso_frame_desc[i].length;
-			}
-		}
+		ret = -EOPNOTSUPP;
+		goto end_unlock;
 	}
-	else if(unlikely(is_in || !tb_len || !urbp->urb->transfer_buffer))
+
+	first = data_window_alloc(w, pages);
+	if(unlikely(first < 0))
 	{
-		ret = -ENODATA;
+		ret = first;
 		goto end_unlock;
 	}
 
-	if(likely(!is_in && tb_len))
+	// From now on the urb can't be given back before run_revokes has removed the mapping.
+	urbp->data_mapped = 1;
+	urbp->map_index = i;
+	w->map[i].handle = handle;
+	w->map[i].first = first;
+	w->map[i].pages = pages;
+	spin_unlock_irqrestore(&vhc->lock, flags);
+
+	pfn = virt_to_phys(buf) >> PAGE_SHIFT;
+	ret = data_window_apply(w, mm, first, pages, pfn);
+	if(unlikely(ret))
 	{
-		if(unlikely(!user_buf || user_len < tb_len))
-		{
-			ret = -EINVAL;
-			goto end_unlock;
-		}
-		memcpy(user_buf_tmp, urbp->urb->transfer_buffer, tb_len);
+		// run_revokes cleans up, when the ioctl returns
+		spin_lock_irqsave(&vhc->lock, flags);
+		revoke_locked(ifcp, urbp);
+		goto end_unlock;
 	}
 
-	// we have copied all data into our private buffers, so we can release the spinlock
+	__put_user((u64)first << PAGE_SHIFT, &arg->offset);
+	__put_user(tb_len, &arg->buffer_length);
+	goto end;
+
+end_unlock:
 	spin_unlock_irqrestore(&vhc->lock, flags);
+end:
+	mutex_unlock(&w->mutex);
+	up_write(&mm->mmap_sem);
+	return ret;
+}
+#endif
+
+#ifdef CONFIG_COMPAT
+// called in device_ioctl only
+static int ioc_giveback32(struct usb_vhci_hcd *vhc, const struct usb_vhci_ioc_giveback32 __user *arg)
+{
+	struct vhci_giveback_desc gb;
+	u32 buf32, iso32;
+
+#ifdef DEBUG
+	if(debug_output) dev_dbg(vhcihcd_to_dev(vhc), "cmd=USB_VHCI_HCD_IOCGIVEBACK32\n");
+#endif
+
+	__get_user(gb.handle, &arg->handle);
+	__get_user(gb.status, &arg->status);
+	__get_user(gb.act, &arg->buffer_actual);
+	__get_user(gb.iso_count, &arg->packet_count);
+	__get_user(gb.err_count, &arg->error_count);
+	__get_user(buf32, &arg->buffer);
+	__get_user(iso32, &arg->iso_packets);
+	if(unlikely(!gb.handle))
+		return -EINVAL;
+	gb.buf = compat_ptr(buf32);
+	gb.iso = compat_ptr(iso32);
+	gb.fixed = NULL;
+	gb.iov = NULL;
+	return ioc_giveback_common(vhc, &gb);
+}
 
-	// since we do not hold the spinlock any longer, we can now safely write the user-mode buffers
+// Reads *count giveback descriptors (at most USB_VHCI_GIVEBACK_BATCH_MAX) from user space and
+// gives back the urbs. The results are written to user_result, if it isn't NULL. *count receives
+// the number of entries which were processed.
+// called in ioc_giveback_batch32 and ioc_giveback_fetch32 only
+static int giveback_batch32(struct usb_vhci_hcd *vhc, const struct usb_vhci_ioc_giveback32 __user *user_gb, __s32 __user *user_result, int *count)
+{
+	struct usb_vhci_ioc_giveback32 tmp;
+	struct vhci_giveback_desc *gb;
+	int i, n = *count, ret = 0;
+
+	if(n > USB_VHCI_GIVEBACK_BATCH_MAX)
+		n = USB_VHCI_GIVEBACK_BATCH_MAX;
+	if(unlikely(user_result && !access_ok(VERIFY_WRITE, user_result, n * sizeof *user_result)))
+		return -EFAULT;
+
+	gb = get_bounce(vhcihcd_to_ifcp(vhc), n * sizeof *gb);
+	if(unlikely(!gb))
+		return -ENOMEM;
 
-	if(likely(is_iso && iso_count))
+	for(i = 0; i < n; i++)
 	{
-		if(unlikely(copy_to_user(iso, iso_tmp, iso_count * sizeof *iso_tmp)))
+		if(unlikely(copy_from_user(&tmp, &user_gb[i], sizeof tmp)))
 		{
 			ret = -EFAULT;
 			goto end;
 		}
-	}
-
-	if(likely(!is_in && tb_len))
-	{
-		if(unlikely(copy_to_user(user_buf, user_buf_tmp, tb_len)))
+		if(unlikely(!tmp.handle))
 		{
-			ret = -EFAULT;
+			ret = -EINVAL;
 			goto end;
 		}
+		gb[i].handle = tmp.handle;
+		gb[i].status = tmp.status;
+		gb[i].act = tmp.buffer_actual;
+		gb[i].iso_count = tmp.packet_count;
+		gb[i].err_count = tmp.error_count;
+		gb[i].buf = compat_ptr(tmp.buffer);
+		gb[i].iso = compat_ptr(tmp.iso_packets);
+		gb[i].fixed = NULL;
+		gb[i].iov = NULL;
 	}
 
-	goto end;
-end_unlock:
-	spin_unlock_irqrestore(&vhc->lock, flags);
+	ioc_giveback_batch_common(vhc, gb, n, 0);
+
+	if(user_result)
+	{
+		for(i = 0; i < n; i++)
+			__put_user(gb[i].result, &user_result[i]);
+	}
+	*count = n;
+
 end:
-	kfree(user_buf_tmp);
-	kfree(iso_tmp);
+	put_bounce(vhcihcd_to_ifcp(vhc), gb, n * sizeof *gb);
 	return ret;
 }
 
 // called in device_ioctl only
-static int ioc_fetch_data(struct usb_vhci_hcd *vhc, struct usb_vhci_ioc_urb_data __user *arg)
+static int ioc_giveback_batch32(struct usb_vhci_hcd *vhc, struct usb_vhci_ioc_giveback_batch32 __user *arg)
 {
-	struct usb_vhci_ioc_iso_packet_data __user *iso;
-	const void *handle;
-	void __user *user_buf;
-	u64 handle64;
-	int user_len, iso_count;
+	const struct usb_vhci_ioc_giveback32 __user *user_gb;
+	__s32 __user *user_result;
+	u32 user_gb32, user_result32;
+	s32 count;
+	int n, ret;
+
+	__get_user(user_gb32, &arg->giveback);
+	__get_user(user_result32, &arg->result);
+	__get_user(count, &arg->count);
+	user_gb = compat_ptr(user_gb32);
+	user_result = compat_ptr(user_result32);
 
 #ifdef DEBUG
-	if(debug_output) dev_dbg(vhcihcd_to_dev(vhc), "cmd=USB_VHCI_HCD_IOCFETCHDATA\n");
+	if(debug_output) dev_dbg(vhcihcd_to_dev(vhc), "cmd=USB_VHCI_HCD_IOCGIVEBACK_BATCH32 [count=%d]\n", (int)count);
 #endif
 
-	if(sizeof(void *) > 4)
-		__get_user(handle64, &arg->handle);
-	else
-	{
-		u32 handle1, handle2;
-		__get_user(handle1, (u32 __user *)&arg->handle);
-		__get_user(handle2, (u32 __user *)&arg->handle + 1);
-		*((u32 *)&handle64) = handle1;
-		*((u32 *)&handle64 + 1) = handle2;
-		if(handle64 >> 32)
-			return -EINVAL;
-	}
-	__get_user(user_len, &arg->buffer_length);
-	__get_user(iso_count, &arg->packet_count);
-	__get_user(user_buf, &arg->buffer);
-	__get_user(iso, &arg->iso_packets);
-	handle = (const void *)(unsigned long)handle64;
-	if(unlikely(!handle))
+	if(unlikely(count <= 0 || !user_gb || !user_result))
 		return -EINVAL;
-	return ioc_fetch_data_common(vhc, handle, user_buf, user_len, iso, iso_count);
+	n = count;
+	ret = giveback_batch32(vhc, user_gb, user_result, &n);
+	if(likely(!ret))
+		__put_user(n, &arg->count);
+	return ret;
 }
 
-#ifdef CONFIG_COMPAT
 // called in device_ioctl only
-static int ioc_giveback32(struct usb_vhci_hcd *vhc, const struct usb_vhci_ioc_giveback32 __user *arg)
+static int ioc_giveback_fetch32(struct usb_vhci_hcd *vhc, struct usb_vhci_ioc_giveback_fetch32 __user *arg)
 {
-	const struct usb_vhci_ioc_iso_packet_giveback __user *iso;
-	const void __user *buf;
-	const void *handle;
-	u64 handle64;
-	int status, act, iso_count, err_count;
-	u32 buf32, iso32;
+	const struct usb_vhci_ioc_giveback32 __user *user_gb;
+	__s32 __user *user_result;
+	u32 user_gb32, user_result32;
+	struct usb_vhci_ioc_work __user *user_work;
+	u32 user_work32;
+	s32 count, work_count;
+	s16 timeout;
+	int n, ret;
+
+	__get_user(user_gb32, &arg->giveback);
+	__get_user(user_result32, &arg->result);
+	__get_user(count, &arg->count);
+	user_gb = compat_ptr(user_gb32);
+	user_result = compat_ptr(user_result32);
+	__get_user(user_work32, &arg->work);
+	user_work = compat_ptr(user_work32);
+	__get_user(work_count, &arg->work_count);
+	__get_user(timeout, &arg->timeout);
 
 #ifdef DEBUG
-	if(debug_output) dev_dbg(vhcihcd_to_dev(vhc), "cmd=USB_VHCI_HCD_IOCGIVEBACK32\n");
+	// Floods the logs
+	//if(debug_output) dev_dbg(vhcihcd_to_dev(vhc), "cmd=USB_VHCI_HCD_IOCGIVEBACK_FETCH32 [count=%d]\n", (int)count);
 #endif
 
-	__get_user(handle64, &arg->handle);
-	__get_user(status, &arg->status);
-	__get_user(act, &arg->buffer_actual);
-	__get_user(iso_count, &arg->packet_count);
-	__get_user(err_count, &arg->error_count);
-	__get_user(buf32, &arg->buffer);
+	n = 0;
+	if(count > 0)
+	{
+		if(unlikely(!user_gb))
+			return -EINVAL;
+		n = count;
+		ret = giveback_batch32(vhc, user_gb, user_result, &n);
+		if(unlikely(ret))
+			return ret;
+	}
+	__put_user(n, &arg->count);
+
+	return ioc_fetch_work_batch_common(vhc, user_work, work_count, timeout, &arg->work_count);
+}
+
+// called in device_ioctl only
+static int ioc_fetch_work_batch32(struct usb_vhci_hcd *vhc, struct usb_vhci_ioc_work_batch32 __user *arg)
+{
+	u32 user_work32;
+	s32 count;
+	s16 timeout;
+
+	__get_user(user_work32, &arg->work);
+	__get_user(count, &arg->count);
+	__get_user(timeout, &arg->timeout);
+	return ioc_fetch_work_batch_common(vhc, compat_ptr(user_work32), count, timeout, &arg->count);
+}
+
+// called in device_ioctl only
+static int ioc_fetch_work_data32(struct usb_vhci_hcd *vhc, struct usb_vhci_ioc_work_data32 __user *arg)
+{
+	u32 user_buf32, iso32;
+	int user_len, iso_count;
+	s16 timeout;
+
+	__get_user(timeout, &arg->work.timeout);
+	__get_user(user_buf32, &arg->buffer);
+	__get_user(user_len, &arg->buffer_length);
 	__get_user(iso32, &arg->iso_packets);
-	handle = (const void *)(unsigned long)handle64;
-	if(unlikely(!handle))
-		return -EINVAL;
-	buf = compat_ptr(buf32);
-	iso = compat_ptr(iso32);
-	return ioc_giveback_common(vhc, handle, status, act, iso_count, err_count, buf, iso);
+	__get_user(iso_count, &arg->packet_count);
+	return ioc_fetch_work_data_common(vhc, &arg->work, timeout, compat_ptr(user_buf32), user_len, compat_ptr(iso32), iso_count, &arg->flags);
 }
 
 // called in device_ioctl only
@@ -895,8 +3355,8 @@ static int ioc_fetch_data32(struct usb_vhci_hcd *vhc, struct usb_vhci_ioc_urb_da
 {
 	struct usb_vhci_ioc_iso_packet_data __user *iso;
 	void __user *user_buf;
-	const void *handle;
-	u64 handle64;
+	struct iovec iov;
+	u64 handle;
 	int user_len, iso_count;
 	u32 user_buf32, iso32;
 
@@ -904,17 +3364,52 @@ static int ioc_fetch_data32(struct usb_vhci_hcd *vhc, struct usb_vhci_ioc_urb_da
 	if(debug_output) dev_dbg(vhcihcd_to_dev(vhc), "cmd=USB_VHCI_HCD_IOCFETCHDATA32\n");
 #endif
 
-	__get_user(handle64, &arg->handle);
+	__get_user(handle, &arg->handle);
 	__get_user(user_len, &arg->buffer_length);
 	__get_user(iso_count, &arg->packet_count);
 	__get_user(user_buf32, &arg->buffer);
 	__get_user(iso32, &arg->iso_packets);
-	handle = (const void *)(unsigned long)handle64;
 	if(unlikely(!handle))
 		return -EINVAL;
 	user_buf = compat_ptr(user_buf32);
 	iso = compat_ptr(iso32);
-	return ioc_fetch_data_common(vhc, handle, user_buf, user_len, iso, iso_count);
+	iov.iov_base = user_buf;
+	iov.iov_len = user_buf && user_len > 0 ? user_len : 0;
+	return ioc_fetch_data_common(vhc, handle, &iov, 1, iso, iso_count);
+}
+// called in device_ioctl only
+static int ioc_fetch_data_iov32(struct usb_vhci_hcd *vhc, const struct usb_vhci_ioc_urb_data_iov32 __user *arg)
+{
+	struct usb_vhci_ioc_urb_data_iov32 tmp;
+
+#ifdef DEBUG
+	if(debug_output) dev_dbg(vhcihcd_to_dev(vhc), "cmd=USB_VHCI_HCD_IOCFETCHDATA_IOV32\n");
+#endif
+
+	if(unlikely(copy_from_user(&tmp, arg, sizeof tmp)))
+		return -EFAULT;
+	return ioc_fetch_data_iov_common(vhc, tmp.handle, compat_ptr(tmp.iov), tmp.iov_count, compat_ptr(tmp.iso_packets), tmp.packet_count, 1);
+}
+
+// called in device_ioctl only
+static int ioc_giveback_iov32(struct usb_vhci_hcd *vhc, const struct usb_vhci_ioc_giveback_iov32 __user *arg)
+{
+	struct usb_vhci_ioc_giveback_iov32 tmp;
+	struct vhci_giveback_desc gb;
+
+#ifdef DEBUG
+	if(debug_output) dev_dbg(vhcihcd_to_dev(vhc), "cmd=USB_VHCI_HCD_IOCGIVEBACK_IOV32\n");
+#endif
+
+	if(unlikely(copy_from_user(&tmp, arg, sizeof tmp)))
+		return -EFAULT;
+	gb.handle = tmp.handle;
+	gb.status = tmp.status;
+	gb.act = tmp.buffer_actual;
+	gb.iso_count = tmp.packet_count;
+	gb.err_count = tmp.error_count;
+	gb.iso = compat_ptr(tmp.iso_packets);
+	return ioc_giveback_iov_common(vhc, &gb, compat_ptr(tmp.iov), tmp.iov_count, 1);
 }
 #endif
 
@@ -971,6 +3466,78 @@ static long device_do_ioctl(struct file *file,
 		ret = ioc_fetch_data(vhc, (struct usb_vhci_ioc_urb_data __user *)arg);
 		break;
 
+	case USB_VHCI_HCD_IOCFETCHWORK_BATCH:
+		ret = ioc_fetch_work_batch(vhc, (struct usb_vhci_ioc_work_batch __user *)arg);
+		break;
+
+	case USB_VHCI_HCD_IOCGIVEBACK_BATCH:
+		ret = ioc_giveback_batch(vhc, (struct usb_vhci_ioc_giveback_batch __user *)arg);
+		break;
+
+	case USB_VHCI_HCD_IOCFETCHWORK_DATA:
+		ret = ioc_fetch_work_data(vhc, (struct usb_vhci_ioc_work_data __user *)arg);
+		break;
+
+	case USB_VHCI_HCD_IOCGIVEBACK_FETCH:
+		ret = ioc_giveback_fetch(vhc, (struct usb_vhci_ioc_giveback_fetch __user *)arg);
+		break;
+
+	case USB_VHCI_HCD_IOCSETUP_RINGS:
+		ret = ioc_setup_rings(vhc, (struct usb_vhci_ioc_setup_rings __user *)arg);
+		break;
+
+	case USB_VHCI_HCD_IOCRING_DOORBELL:
+		ret = ioc_ring_doorbell(vhc, (struct usb_vhci_ioc_ring_doorbell __user *)arg);
+		break;
+
+	case USB_VHCI_HCD_IOCMAPDATA:
+#ifndef NO_ZAP_VMA_PTES
+		ret = ioc_map_data(vhc, (struct usb_vhci_ioc_map_data __user *)arg);
+#else
+		ret = -EOPNOTSUPP;
+#endif
+		break;
+
+	case USB_VHCI_HCD_IOCREGISTER_BUFFERS:
+		ret = ioc_register_buffers(vhc, (struct usb_vhci_ioc_register_buffers __user *)arg);
+		break;
+
+	case USB_VHCI_HCD_IOCGIVEBACK_FIXED:
+		ret = ioc_giveback_fixed(vhc, (struct usb_vhci_ioc_giveback_fixed __user *)arg);
+		break;
+
+	case USB_VHCI_HCD_IOCGIVEBACK_FD:
+		ret = ioc_giveback_fd(vhc, (struct usb_vhci_ioc_giveback_fd __user *)arg);
+		break;
+
+	case USB_VHCI_HCD_IOCFETCHDATA_FD:
+		ret = ioc_fetch_data_fd(vhc, (struct usb_vhci_ioc_fetch_data_fd __user *)arg);
+		break;
+
+	case USB_VHCI_HCD_IOCFETCHDATA_IOV:
+		ret = ioc_fetch_data_iov(vhc, (struct usb_vhci_ioc_urb_data_iov __user *)arg);
+		break;
+
+	case USB_VHCI_HCD_IOCFETCHWORK_NS:
+		ret = ioc_fetch_work_ns(vhc, (struct usb_vhci_ioc_work_ns __user *)arg);
+		break;
+
+	case USB_VHCI_HCD_IOCSET_EVENTFD:
+#ifndef NO_EVENTFD_CTX
+		ret = ioc_set_eventfd(vhc, (struct usb_vhci_ioc_eventfd __user *)arg);
+#else
+		ret = -EOPNOTSUPP;
+#endif
+		break;
+
+	case USB_VHCI_HCD_IOCSET_BUSY_POLL:
+		ret = ioc_set_busy_poll(vhc, (struct usb_vhci_ioc_busy_poll __user *)arg);
+		break;
+
+	case USB_VHCI_HCD_IOCGIVEBACK_IOV:
+		ret = ioc_giveback_iov(vhc, (struct usb_vhci_ioc_giveback_iov __user *)arg);
+		break;
+
 #ifdef CONFIG_COMPAT
 	case USB_VHCI_HCD_IOCGIVEBACK32:
 		ret = ioc_giveback32(vhc, (struct usb_vhci_ioc_giveback32 __user *)arg);
@@ -979,12 +3546,38 @@ static long device_do_ioctl(struct file *file,
 	case USB_VHCI_HCD_IOCFETCHDATA32:
 		ret = ioc_fetch_data32(vhc, (struct usb_vhci_ioc_urb_data32 __user *)arg);
 		break;
+
+	case USB_VHCI_HCD_IOCFETCHWORK_BATCH32:
+		ret = ioc_fetch_work_batch32(vhc, (struct usb_vhci_ioc_work_batch32 __user *)arg);
+		break;
+
+	case USB_VHCI_HCD_IOCGIVEBACK_BATCH32:
+		ret = ioc_giveback_batch32(vhc, (struct usb_vhci_ioc_giveback_batch32 __user *)arg);
+		break;
+
+	case USB_VHCI_HCD_IOCFETCHWORK_DATA32:
+		ret = ioc_fetch_work_data32(vhc, (struct usb_vhci_ioc_work_data32 __user *)arg);
+		break;
+
+	case USB_VHCI_HCD_IOCGIVEBACK_FETCH32:
+		ret = ioc_giveback_fetch32(vhc, (struct usb_vhci_ioc_giveback_fetch32 __user *)arg);
+		break;
+
+	case USB_VHCI_HCD_IOCFETCHDATA_IOV32:
+		ret = ioc_fetch_data_iov32(vhc, (struct usb_vhci_ioc_urb_data_iov32 __user *)arg);
+		break;
+
+	case USB_VHCI_HCD_IOCGIVEBACK_IOV32:
+		ret = ioc_giveback_iov32(vhc, (struct usb_vhci_ioc_giveback_iov32 __user *)arg);
+		break;
 #endif
 
 	default:
 		ret = -ENOTTY;
 	}
 
+	// givebacks and cancelations may have left data mappings behind which have to be removed
+	run_revokes(vhcidev_to_ifcp(vdev), vhc);
 	return ret;
 }
 
@@ -1004,6 +3597,477 @@ static long device_ioctl32(struct file *file,
 }
 #endif
 
+// Builds work records (see struct usb_vhci_work_record) in buf until there is no more work or
+// until the next record header doesn't fit. The data of OUT and ISO urbs is inlined, if it fits.
+// Returns the number of bytes used.
+// caller has vhc->lock and has irq disabled
+static size_t fill_work_records_locked(struct usb_vhci_hcd *vhc, char *buf, size_t size)
+{
+	struct usb_vhci_work_record *rec;
+	struct usb_vhci_urb_priv *urbp;
+	size_t off = 0, next, space, iso_bytes;
+	int inlined, buf_len;
+
+	while(size - off >= sizeof *rec)
+	{
+		rec = (struct usb_vhci_work_record *)(buf + off);
+		// buf is a reused bounce buffer, so nothing may go to user space which wasn't written here
+		memset(rec, 0, sizeof *rec);
+		if(fetch_work_locked(vhc, &rec->work, &urbp))
+			break;
+		space = size - off - sizeof *rec;
+		rec->length = sizeof *rec;
+		rec->flags = 0;
+		memset(rec->reserved, 0, sizeof rec->reserved);
+		if(urbp)
+		{
+			// the iso packets come first, the payload follows
+			iso_bytes = rec->work.work.urb.packet_count * sizeof(struct usb_vhci_ioc_iso_packet_data);
+			buf_len = (iso_bytes <= space) ? (int)(space - iso_bytes) : -1;
+			inlined = inline_data_locked(urbp, &rec->work.work.urb,
+			                             (char *)(rec + 1) + iso_bytes, buf_len,
+			                             (struct usb_vhci_ioc_iso_packet_data *)(rec + 1),
+			                             space / sizeof(struct usb_vhci_ioc_iso_packet_data));
+			if(inlined >= 0)
+			{
+				rec->length += iso_bytes + inlined;
+				rec->flags = USB_VHCI_WORK_DATA_INLINED;
+			}
+		}
+		next = off + ALIGN(rec->length, USB_VHCI_RECORD_ALIGN);
+		if(next > size)
+			next = size;
+		memset(buf + off + rec->length, 0, next - off - rec->length);
+		off = next;
+	}
+	return off;
+}
+
+// Returns a stream of work records. Blocks until there is at least one record, unless the file
+// was opened with O_NONBLOCK.
+static ssize_t device_read(struct file *file,
+                           char __user *buffer,
+                           size_t length,
+                           loff_t *offset)
+{
+	struct usb_vhci_device *vdev = file->private_data;
+	struct vhci_ifc_priv *ifcp;
+	struct usb_vhci_hcd *vhc;
+	unsigned long flags;
+	size_t n = 0;
+	char *buf;
+	int ret, more;
+
+	if(unlikely(!vdev))
+		return -EPROTO;
+	if(unlikely(length < sizeof(struct usb_vhci_work_record)))
+		return -EINVAL;
+	if(length > USB_VHCI_RECORD_BUFFER_MAX)
+		length = USB_VHCI_RECORD_BUFFER_MAX;
+	vhc = vhcidev_to_vhcihcd(vdev);
+	ifcp = vhcidev_to_ifcp(vdev);
+
+	buf = get_bounce(ifcp, length);
+	if(unlikely(!buf))
+		return -ENOMEM;
+
+	for(;;)
+	{
+		drain_begin(ifcp);
+		spin_lock_irqsave(&vhc->lock, flags);
+		n = fill_work_records_locked(vhc, buf, length);
+		more = drain_end(ifcp, vhc);
+		spin_unlock_irqrestore(&vhc->lock, flags);
+		if(more)
+			pass_on_work(ifcp);
+		if(n)
+			break;
+		if(file->f_flags & O_NONBLOCK)
+		{
+			ret = -EAGAIN;
+			goto end;
+		}
+		if(unlikely(wait_work_exclusive(ifcp, vhc, MAX_SCHEDULE_TIMEOUT) < 0))
+		{
+			ret = -ERESTARTSYS;
+			goto end;
+		}
+	}
+
+#ifdef DEBUG
+	if(debug_output) dev_dbg(vhcihcd_to_dev(vhc), "read: %lu bytes of work records\n", (unsigned long)n);
+#endif
+
+	// the work has been taken already, so there is nothing we can do if this fails
+	ret = copy_to_user(buffer, buf, n) ? -EFAULT : n;
+
+end:
+	put_bounce(ifcp, buf, length);
+	run_revokes(ifcp, vhc);
+	return ret;
+}
+
+#ifndef NO_USE_MM
+// A read through the aio interface. It stays queued until there is work and is completed by
+// aio_work_fn, so that no thread has to block while it is pending.
+struct vhci_aio_read
+{
+	struct list_head list;  // in aio_list (empty while the worker or the cancel owns it)
+	struct kiocb *iocb;
+	struct mm_struct *mm;   // address space of the submitter (we hold a reference)
+	unsigned long nr_segs;
+	struct iovec iov[0];    // the segments which are filled with work records
+};
+
+static void finish_aio_read(struct vhci_aio_read *req, long res)
+{
+	aio_complete(req->iocb, res, 0);
+	mmput(req->mm);
+	kfree(req);
+}
+
+static int device_aio_cancel(struct kiocb *iocb, struct io_event *event)
+{
+	struct vhci_aio_read *req = iocb->private;
+	struct vhci_ifc_priv *ifcp = file_to_ifcp(iocb->ki_filp);
+	unsigned long flags;
+	int found = 0;
+
+	spin_lock_irqsave(&ifcp->aio_lock, flags);
+	if(!list_empty(&req->list))
+	{
+		list_del_init(&req->list);
+		found = 1;
+	}
+	spin_unlock_irqrestore(&ifcp->aio_lock, flags);
+
+	if(found)
+	{
+		event->res = -ECANCELED;
+		finish_aio_read(req, -ECANCELED);
+	}
+
+	// the caller took a reference for us
+	aio_put_req(iocb);
+
+	// if it wasn't found, the worker is completing it right now
+	return found ? 0 : -EAGAIN;
+}
+
+// Fills pending aio reads with work records as long as there is work.
+static void aio_work_fn(struct work_struct *work)
+{
+	struct vhci_ifc_priv *ifcp = container_of(work, struct vhci_ifc_priv, aio_work);
+	struct usb_vhci_hcd *vhc = vhcidev_to_vhcihcd(ifc_to_vhcidev(ifcp));
+	struct vhci_aio_read *req;
+	unsigned long flags, seg;
+	size_t n, length, total;
+	long res;
+	char *buf;
+	int more, fault;
+
+	while(usb_vhci_hcd_has_work(vhc))
+	{
+		spin_lock_irqsave(&ifcp->aio_lock, flags);
+		req = NULL;
+		if(!list_empty(&ifcp->aio_list))
+		{
+			req = list_entry(ifcp->aio_list.next, struct vhci_aio_read, list);
+			list_del_init(&req->list);
+		}
+		spin_unlock_irqrestore(&ifcp->aio_lock, flags);
+		if(!req)
+			break;
+
+		// like readv does for read: every segment gets its own records, and a segment which
+		// isn't filled completely is the last one
+		total = 0;
+		res = 0;
+		for(seg = 0; seg < req->nr_segs; seg++)
+		{
+			length = min_t(size_t, req->iov[seg].iov_len, USB_VHCI_RECORD_BUFFER_MAX);
+			buf = get_bounce(ifcp, length);
+			if(unlikely(!buf))
+			{
+				res = -ENOMEM;
+				break;
+			}
+
+			drain_begin(ifcp);
+			spin_lock_irqsave(&vhc->lock, flags);
+			n = fill_work_records_locked(vhc, buf, length);
+			more = drain_end(ifcp, vhc);
+			spin_unlock_irqrestore(&vhc->lock, flags);
+			if(more)
+				pass_on_work(ifcp);
+
+			fault = 0;
+			if(n)
+			{
+				// the work has been taken already, so there is nothing we can do if this fails
+				use_mm(req->mm);
+				fault = copy_to_user(req->iov[seg].iov_base, buf, n) != 0;
+				unuse_mm(req->mm);
+			}
+			put_bounce(ifcp, buf, length);
+			if(unlikely(fault))
+			{
+				res = -EFAULT;
+				break;
+			}
+			total += n;
+			if(n != req->iov[seg].iov_len)
+				break;
+		}
+		n = total;
+
+		if(n || res)
+			finish_aio_read(req, n ? (long)n : res);
+		else
+		{
+			// somebody else was faster; wait for the next event (unless it was canceled meanwhile)
+			spin_lock_irqsave(&ifcp->aio_lock, flags);
+			if(likely(!kiocbIsCancelled(req->iocb)))
+			{
+				list_add(&req->list, &ifcp->aio_list);
+				req = NULL;
+			}
+			spin_unlock_irqrestore(&ifcp->aio_lock, flags);
+			if(req)
+				finish_aio_read(req, -ECANCELED);
+		}
+		if(!n)
+			break;
+	}
+}
+
+// The segments are filled like the VFS fills them for a driver without aio_read (readv calls read
+// for each segment until one isn't filled completely), so every segment holds complete records.
+// Only the first segment may block; synchronous calls (readv) go through device_read.
+static ssize_t device_aio_read(struct kiocb *iocb, const struct iovec *iov, unsigned long nr_segs, loff_t pos)
+{
+	struct usb_vhci_device *vdev = iocb->ki_filp->private_data;
+	struct vhci_ifc_priv *ifcp;
+	struct vhci_aio_read *req;
+	unsigned long flags, seg;
+	ssize_t ret, total = 0;
+
+	if(unlikely(!vdev))
+		return -EPROTO;
+	if(unlikely(!nr_segs || nr_segs > UIO_MAXIOV))
+		return -EINVAL;
+	if(is_sync_kiocb(iocb))
+	{
+		for(seg = 0; seg < nr_segs; seg++)
+		{
+			ret = device_read(iocb->ki_filp, iov[seg].iov_base, iov[seg].iov_len, &pos);
+			if(ret < 0)
+				return total ? total : ret;
+			total += ret;
+			if(ret != iov[seg].iov_len)
+				break;
+			// don't wait for more work for the next segment
+			if(!usb_vhci_hcd_has_work(vdev->vhc))
+				break;
+		}
+		return total;
+	}
+	if(unlikely(iov->iov_len < sizeof(struct usb_vhci_work_record)))
+		return -EINVAL;
+	ifcp = vhcidev_to_ifcp(vdev);
+
+	req = kmalloc(sizeof *req + nr_segs * sizeof *iov, GFP_KERNEL);
+	if(unlikely(!req))
+		return -ENOMEM;
+	req->iocb = iocb;
+	req->mm = current->mm;
+	atomic_inc(&req->mm->mm_users);
+	req->nr_segs = nr_segs;
+	memcpy(req->iov, iov, nr_segs * sizeof *iov);
+	iocb->private = req;
+	iocb->ki_cancel = device_aio_cancel;
+
+	spin_lock_irqsave(&ifcp->aio_lock, flags);
+	list_add_tail(&req->list, &ifcp->aio_list);
+	spin_unlock_irqrestore(&ifcp->aio_lock, flags);
+
+	// there may be work already, which won't trigger an event anymore
+	if(usb_vhci_hcd_has_work(vdev->vhc))
+		schedule_work(&ifcp->aio_work);
+	return -EIOCBQUEUED;
+}
+#endif
+
+// Takes a stream of giveback records (see struct usb_vhci_giveback_record). Only complete records
+// are processed; the number of bytes which were consumed is returned. The data and the iso packets
+// are copied directly from the user buffer.
+// Processing stops at the first record which fails. If it is the first record of this call, its
+// error is returned; otherwise the number of bytes before it is returned, and its error is
+// returned by the next call (without consuming anything), unless the urb of the record wasn't
+// given back (-ENOENT, -EBUSY). So the caller always sees the error of a consumed record.
+static ssize_t device_write(struct file *file,
+                            const char __user *buffer,
+                            size_t length,
+                            loff_t *offset)
+{
+	struct usb_vhci_device *vdev = file->private_data;
+	struct usb_vhci_giveback_record rec;
+	struct vhci_giveback_desc *gb;
+	struct vhci_ifc_priv *ifcp;
+	struct usb_vhci_hcd *vhc;
+	size_t off = 0, iso_bytes, data_bytes;
+	ssize_t err;
+	int n, done, i, stop = 0;
+
+	if(unlikely(!vdev))
+		return -EPROTO;
+	vhc = vhcidev_to_vhcihcd(vdev);
+	ifcp = vhcidev_to_ifcp(vdev);
+
+	// the error of a record which failed during the previous call
+	err = atomic_xchg(&ifcp->write_err, 0);
+	if(unlikely(err))
+		return err;
+	err = -EINVAL;
+
+	gb = get_bounce(ifcp, USB_VHCI_GIVEBACK_BATCH_MAX * sizeof *gb);
+	if(unlikely(!gb))
+		return -ENOMEM;
+
+	while(!stop)
+	{
+		n = 0;
+		while(n < USB_VHCI_GIVEBACK_BATCH_MAX && length - off >= sizeof rec)
+		{
+			if(unlikely(copy_from_user(&rec, buffer + off, sizeof rec)))
+			{
+				err = -EFAULT;
+				stop = 1;
+				break;
+			}
+			if(unlikely(rec.packet_count < 0 || rec.packet_count > USB_VHCI_WORK_DATA_MAX_PACKETS))
+				goto invalid;
+			iso_bytes = rec.packet_count * sizeof(struct usb_vhci_ioc_iso_packet_giveback);
+			if(unlikely(rec.length < sizeof rec + iso_bytes))
+				goto invalid;
+			if(rec.length > length - off)
+			{
+				stop = 1; // incomplete record
+				break;
+			}
+			data_bytes = rec.length - sizeof rec - iso_bytes;
+			// (OUT urbs report buffer_actual without any data; giveback_check knows the direction)
+			if(unlikely(!rec.handle || rec.buffer_actual < 0 || (data_bytes && rec.buffer_actual > data_bytes)))
+				goto invalid;
+			if(unlikely(!access_ok(VERIFY_READ, buffer + off, rec.length)))
+			{
+				err = -EFAULT;
+				stop = 1;
+				break;
+			}
+
+			gb[n].handle = rec.handle;
+			gb[n].status = rec.status;
+			gb[n].act = rec.buffer_actual;
+			gb[n].iso_count = rec.packet_count;
+			gb[n].err_count = rec.error_count;
+			gb[n].iso = rec.packet_count ? (const struct usb_vhci_ioc_iso_packet_giveback __user *)(buffer + off + sizeof rec) : NULL;
+			gb[n].fixed = NULL;
+			gb[n].iov = NULL;
+			gb[n].buf = data_bytes ? buffer + off + sizeof rec + iso_bytes : NULL;
+			gb[n].offset = off;
+			n++;
+			off += ALIGN(rec.length, USB_VHCI_RECORD_ALIGN);
+			if(off > length)
+				off = length;
+			continue;
+
+		invalid:
+#ifdef DEBUG
+			if(debug_output) dev_dbg(vhcihcd_to_dev(vhc), "write: invalid giveback record at offset %lu\n", (unsigned long)off);
+#endif
+			stop = 1;
+			break;
+		}
+		if(!n)
+			break;
+
+		done = ioc_giveback_batch_common(vhc, gb, n, 1);
+		for(i = 0; i < done; i++)
+		{
+			if(likely(!gb[i].result || gb[i].result == -ECANCELED))
+				continue;
+			// this record and the ones after it count as not written
+			err = gb[i].result;
+			off = gb[i].offset;
+			if(off && gb[i].urbp)
+				atomic_set(&ifcp->write_err, err);
+			stop = 1;
+			break;
+		}
+	}
+	put_bounce(ifcp, gb, USB_VHCI_GIVEBACK_BATCH_MAX * sizeof *gb);
+	run_revokes(ifcp, vhc);
+
+	// (a single incomplete record is an error, too)
+	if(!off && length)
+		return err;
+	return off;
+}
+
+// maps the rings which were set up by USB_VHCI_HCD_IOCSETUP_RINGS (at offset zero) or the data
+// window (at USB_VHCI_MMAP_DATA_OFFSET)
+static int device_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct usb_vhci_device *vdev = file->private_data;
+	struct vhci_rings *rings;
+	unsigned long size = vma->vm_end - vma->vm_start;
+
+	if(unlikely(!vdev))
+		return -EPROTO;
+#ifndef NO_ZAP_VMA_PTES
+	if(vma->vm_pgoff >= VHCI_DATA_PGOFF)
+		return data_window_mmap(vhcidev_to_ifcp(vdev), vma);
+#endif
+	rings = vhcidev_to_ifcp(vdev)->rings;
+	if(unlikely(!rings))
+		return -ENXIO;
+	if(unlikely(vma->vm_pgoff || size > rings->size))
+		return -EINVAL;
+
+	vma->vm_flags |= VM_RESERVED;
+	return remap_pfn_range(vma, vma->vm_start, virt_to_phys((void *)rings->mem) >> PAGE_SHIFT, size, vma->vm_page_prot);
+}
+
+// The device is readable if there is work to do and it is always writable. (If the rings are set up, only the work ring is
+// taken into account, because the work is moved into the ring by the tasklet.)
+static unsigned int device_poll(struct file *file, poll_table *wait)
+{
+	struct usb_vhci_device *vdev = file->private_data;
+	struct vhci_ifc_priv *ifcp;
+	struct vhci_rings *rings;
+	unsigned int mask = 0;
+
+	if(unlikely(!vdev))
+		return POLLERR;
+	ifcp = vhcidev_to_ifcp(vdev);
+
+	poll_wait(file, &ifcp->work_event, wait);
+
+	// writing giveback records never blocks
+	mask |= POLLOUT | POLLWRNORM;
+
+	rings = ifcp->rings;
+	if(rings)
+	{
+		if(ring_has_work(rings))
+			mask |= POLLIN | POLLRDNORM;
+	}
+	else if(usb_vhci_hcd_has_work(vhcidev_to_vhcihcd(vdev)))
+		mask |= POLLIN | POLLRDNORM;
+	return mask;
+}
+
 static loff_t device_llseek(struct file *file, loff_t offset, int origin)
 {
 	vhci_dbg("%s(file=%p)\n", __FUNCTION__, file);
@@ -1014,11 +4078,16 @@ static struct file_operations fops = {
 	.owner          = THIS_MODULE,
 	.llseek         = device_llseek,
 	.read           = device_read,
+#ifndef NO_USE_MM
+	.aio_read       = device_aio_read,
+#endif
 	.write          = device_write,
+	.poll           = device_poll,
 	.unlocked_ioctl = device_ioctl,
 #ifdef CONFIG_COMPAT
 	.compat_ioctl   = device_ioctl32,
 #endif
+	.mmap           = device_mmap,
 	.open           = device_open,
 	.release        = device_release // a.k.a. close
 };
@@ -1055,6 +4124,43 @@ static ssize_t store_debug_output(struct device_driver *drv, const char *buf, si
 static DRIVER_ATTR(debug_output, S_IRUSR | S_IWUSR, show_debug_output, store_debug_output);
 #endif
 
+static ssize_t show_wakeup_coalescing(struct device_driver *drv, char *buf)
+{
+	return sprintf(buf, "%u\n", wakeup_coalescing);
+}
+
+static ssize_t store_wakeup_coalescing(struct device_driver *drv, const char *buf, size_t count)
+{
+	if(count < 1 || buf == NULL) return -EINVAL;
+	switch(*buf)
+	{
+	case '0': wakeup_coalescing = 0; return count;
+	case '1': wakeup_coalescing = 1; return count;
+	}
+	return -EINVAL;
+}
+
+static DRIVER_ATTR(wakeup_coalescing, S_IRUSR | S_IWUSR, show_wakeup_coalescing, store_wakeup_coalescing);
+
+static ssize_t show_wakeup_delay_us(struct device_driver *drv, char *buf)
+{
+	return sprintf(buf, "%u\n", wakeup_delay_us);
+}
+
+static ssize_t store_wakeup_delay_us(struct device_driver *drv, const char *buf, size_t count)
+{
+	unsigned long val;
+	char *end;
+
+	if(count < 1 || buf == NULL) return -EINVAL;
+	val = simple_strtoul(buf, &end, 10);
+	if(end == buf || val > VHCI_WAKEUP_DELAY_MAX) return -EINVAL;
+	wakeup_delay_us = val;
+	return count;
+}
+
+static DRIVER_ATTR(wakeup_delay_us, S_IRUSR | S_IWUSR, show_wakeup_delay_us, store_wakeup_delay_us);
+
 static struct platform_driver vhci_iocifc_driver = {
 	.driver = {
 		.name   = driver_name,
@@ -1144,6 +4250,12 @@ static int __init init(void)
 		vhci_printk(KERN_DEBUG, "==> ignoring\n");
 	}
 #endif
+	retval = driver_create_file(&vhci_iocifc_driver.driver, &driver_attr_wakeup_coalescing);
+	if(unlikely(retval != 0))
+		vhci_printk(KERN_WARNING, "driver_create_file(&vhci_iocifc_driver, &driver_attr_wakeup_coalescing) failed\n");
+	retval = driver_create_file(&vhci_iocifc_driver.driver, &driver_attr_wakeup_delay_us);
+	if(unlikely(retval != 0))
+		vhci_printk(KERN_WARNING, "driver_create_file(&vhci_iocifc_driver, &driver_attr_wakeup_delay_us) failed\n");
 
 #ifdef DEBUG
 	vhci_printk(KERN_DEBUG, "USB_VHCI_HCD_IOCREGISTER     = %08x\n", (unsigned int)USB_VHCI_HCD_IOCREGISTER);
@@ -1152,6 +4264,22 @@ static int __init init(void)
 	vhci_printk(KERN_DEBUG, "USB_VHCI_HCD_IOCFETCHWORK    = %08x\n", (unsigned int)USB_VHCI_HCD_IOCFETCHWORK);
 	vhci_printk(KERN_DEBUG, "USB_VHCI_HCD_IOCGIVEBACK     = %08x\n", (unsigned int)USB_VHCI_HCD_IOCGIVEBACK);
 	vhci_printk(KERN_DEBUG, "USB_VHCI_HCD_IOCFETCHDATA    = %08x\n", (unsigned int)USB_VHCI_HCD_IOCFETCHDATA);
+	vhci_printk(KERN_DEBUG, "USB_VHCI_HCD_IOCFETCHWORK_BATCH = %08x\n", (unsigned int)USB_VHCI_HCD_IOCFETCHWORK_BATCH);
+	vhci_printk(KERN_DEBUG, "USB_VHCI_HCD_IOCGIVEBACK_BATCH  = %08x\n", (unsigned int)USB_VHCI_HCD_IOCGIVEBACK_BATCH);
+	vhci_printk(KERN_DEBUG, "USB_VHCI_HCD_IOCFETCHWORK_DATA  = %08x\n", (unsigned int)USB_VHCI_HCD_IOCFETCHWORK_DATA);
+	vhci_printk(KERN_DEBUG, "USB_VHCI_HCD_IOCGIVEBACK_FETCH  = %08x\n", (unsigned int)USB_VHCI_HCD_IOCGIVEBACK_FETCH);
+	vhci_printk(KERN_DEBUG, "USB_VHCI_HCD_IOCSETUP_RINGS     = %08x\n", (unsigned int)USB_VHCI_HCD_IOCSETUP_RINGS);
+	vhci_printk(KERN_DEBUG, "USB_VHCI_HCD_IOCRING_DOORBELL   = %08x\n", (unsigned int)USB_VHCI_HCD_IOCRING_DOORBELL);
+	vhci_printk(KERN_DEBUG, "USB_VHCI_HCD_IOCMAPDATA         = %08x\n", (unsigned int)USB_VHCI_HCD_IOCMAPDATA);
+	vhci_printk(KERN_DEBUG, "USB_VHCI_HCD_IOCREGISTER_BUFFERS = %08x\n", (unsigned int)USB_VHCI_HCD_IOCREGISTER_BUFFERS);
+	vhci_printk(KERN_DEBUG, "USB_VHCI_HCD_IOCGIVEBACK_FIXED  = %08x\n", (unsigned int)USB_VHCI_HCD_IOCGIVEBACK_FIXED);
+	vhci_printk(KERN_DEBUG, "USB_VHCI_HCD_IOCGIVEBACK_FD     = %08x\n", (unsigned int)USB_VHCI_HCD_IOCGIVEBACK_FD);
+	vhci_printk(KERN_DEBUG, "USB_VHCI_HCD_IOCFETCHDATA_FD    = %08x\n", (unsigned int)USB_VHCI_HCD_IOCFETCHDATA_FD);
+	vhci_printk(KERN_DEBUG, "USB_VHCI_HCD_IOCFETCHDATA_IOV   = %08x\n", (unsigned int)USB_VHCI_HCD_IOCFETCHDATA_IOV);
+	vhci_printk(KERN_DEBUG, "USB_VHCI_HCD_IOCGIVEBACK_IOV    = %08x\n", (unsigned int)USB_VHCI_HCD_IOCGIVEBACK_IOV);
+	vhci_printk(KERN_DEBUG, "USB_VHCI_HCD_IOCSET_BUSY_POLL   = %08x\n", (unsigned int)USB_VHCI_HCD_IOCSET_BUSY_POLL);
+	vhci_printk(KERN_DEBUG, "USB_VHCI_HCD_IOCFETCHWORK_NS    = %08x\n", (unsigned int)USB_VHCI_HCD_IOCFETCHWORK_NS);
+	vhci_printk(KERN_DEBUG, "USB_VHCI_HCD_IOCSET_EVENTFD     = %08x\n", (unsigned int)USB_VHCI_HCD_IOCSET_EVENTFD);
 #endif
 
 	return 0;
@@ -1160,6 +4288,8 @@ module_init(init);
 
 static void __exit cleanup(void)
 {
+	driver_remove_file(&vhci_iocifc_driver.driver, &driver_attr_wakeup_delay_us);
+	driver_remove_file(&vhci_iocifc_driver.driver, &driver_attr_wakeup_coalescing);
 #ifdef DEBUG
 	driver_remove_file(&vhci_iocifc_driver.driver, &driver_attr_debug_output);
 #endif
@@ -127,9 +127,9 @@ struct usb_vhci_ioc_work
 {
 	__u64 handle;                        // for USB_VHCI_IOC_WORK_TYPE_PROCESS_URB
 	                                     // and USB_VHCI_IOC_WORK_TYPE_CANCEL_URB;
-	                                     // handle which identifies the urb
-	                                     // (it is just a pointer to the urb
-	                                     // in kernel space)
+	                                     // opaque handle which identifies the
+	                                     // urb (it is never zero and becomes
+	                                     // invalid when the urb is given back)
 	union usb_vhci_ioc_work_union work;
 	__s16 timeout;                       // timeout in milliseconds (max. 1000)
 #define USB_VHCI_TIMEOUT_INFINITE     -1
@@ -178,6 +178,355 @@ struct usb_vhci_ioc_giveback
 	__s32 error_count;   // for ISO
 };
 
+// structure for the USB_VHCI_HCD_IOCFETCHWORK_BATCH ioctl
+struct usb_vhci_ioc_work_batch
+{
+	struct usb_vhci_ioc_work *work; // [in]  points to the beginning of the work array
+	__s32 count;                    // [in]  number of entries the array can hold
+	                                // [out] number of entries which were filled
+	                                //       (never more than USB_VHCI_WORK_BATCH_MAX)
+	__s16 timeout;                  // [in]  timeout in milliseconds (max. 1000) for
+	                                //       waiting for the first entry
+};
+#define USB_VHCI_WORK_BATCH_MAX 64
+
+// structure for the USB_VHCI_HCD_IOCGIVEBACK_BATCH ioctl
+struct usb_vhci_ioc_giveback_batch
+{
+	struct usb_vhci_ioc_giveback *giveback; // [in]  points to the beginning of the giveback array
+	__s32 *result;                          // [in]  points to an array of count entries, which
+	                                        //       receives the result for each giveback (0,
+	                                        //       -ECANCELED, -ENOENT or another error code)
+	__s32 count;                            // [in]  number of entries in the giveback array
+	                                        // [out] number of entries which were processed
+	                                        //       (never more than USB_VHCI_GIVEBACK_BATCH_MAX)
+};
+#define USB_VHCI_GIVEBACK_BATCH_MAX 64
+
+// structure for the USB_VHCI_HCD_IOCFETCHWORK_DATA ioctl
+struct usb_vhci_ioc_work_data
+{
+	struct usb_vhci_ioc_work work;  // [in/out] same as for USB_VHCI_HCD_IOCFETCHWORK
+	void *buffer;                   // [in]  buffer for the payload of OUT urbs
+	struct usb_vhci_ioc_iso_packet_data *iso_packets; // [in] buffer for the iso
+	                                                  //      packet array
+	__s32 buffer_length;            // [in]  number of bytes which were allocated
+	                                //       for the buffer
+	__s32 packet_count;             // [in]  number of iso packets which fit into
+	                                //       the iso packet array
+	__u8 flags;                     // [out] flags:
+#define USB_VHCI_WORK_DATA_INLINED 0x01 // payload and iso packets were copied into
+                                        // the buffers (USB_VHCI_HCD_IOCFETCHDATA
+                                        // must not be used for this urb)
+};
+// payloads and iso packet arrays which are larger than this are never inlined
+#define USB_VHCI_WORK_DATA_MAX_BUFFER  4096
+#define USB_VHCI_WORK_DATA_MAX_PACKETS 256
+
+// structure for the USB_VHCI_HCD_IOCGIVEBACK_FETCH ioctl
+// (gives back the urbs like USB_VHCI_HCD_IOCGIVEBACK_BATCH and then fetches work
+// like USB_VHCI_HCD_IOCFETCHWORK_BATCH)
+struct usb_vhci_ioc_giveback_fetch
+{
+	struct usb_vhci_ioc_giveback *giveback; // [in]  points to the beginning of the giveback array
+	__s32 *result;                          // [in]  points to an array of count entries, which
+	                                        //       receives the result for each giveback (may
+	                                        //       be a null pointer)
+	struct usb_vhci_ioc_work *work;         // [in]  points to the beginning of the work array
+	__s32 count;                            // [in]  number of entries in the giveback array
+	                                        //       (may be zero)
+	                                        // [out] number of entries which were processed
+	__s32 work_count;                       // [in]  number of entries the work array can hold
+	                                        // [out] number of entries which were filled
+	__s16 timeout;                          // [in]  timeout in milliseconds (max. 1000) for
+	                                        //       waiting for the first work entry
+};
+
+// header of a ring in the memory which is mapped by mmap after
+// USB_VHCI_HCD_IOCSETUP_RINGS
+// (The producer only writes head and the consumer only writes tail. Entry i
+// lives at index i & mask. The ring is empty if head == tail.)
+struct usb_vhci_ring
+{
+	__u32 head;  // index of the next entry the producer will write
+	__u32 tail;  // index of the next entry the consumer will read
+	__u32 mask;  // number of entries - 1
+	__u32 flags; // flags (only written by the kernel):
+#define USB_VHCI_RING_NEED_DOORBELL 0x00000001 // work ring: the ring ran full
+                                               // (call USB_VHCI_HCD_IOCRING_DOORBELL
+                                               // after consuming entries)
+};
+
+// entry of the completion ring (fields have the same meaning as in
+// struct usb_vhci_ioc_giveback; pointers are stored as 64 bit values)
+struct usb_vhci_ioc_ring_giveback
+{
+	__u64 handle;
+	__u64 buffer;
+	__u64 iso_packets;
+	__s32 status;
+	__s32 buffer_actual;
+	__s32 packet_count;
+	__s32 error_count;
+};
+
+// header of the data slot of a work ring entry (see data_size in
+// struct usb_vhci_ioc_setup_rings)
+struct usb_vhci_ring_data
+{
+	__u32 length;      // number of payload bytes
+	__u8 flags;        // USB_VHCI_WORK_DATA_INLINED if the iso packets and
+	                   // the OUT payload follow
+	__u8 reserved[3];
+	// followed by work.urb.packet_count entries of
+	// struct usb_vhci_ioc_iso_packet_data and by the payload
+	// (only if USB_VHCI_WORK_DATA_INLINED is set)
+};
+
+// structure for the USB_VHCI_HCD_IOCSETUP_RINGS ioctl
+// (The work ring is filled by the kernel with the same entries which
+// USB_VHCI_HCD_IOCFETCHWORK returns. If data_size isn't zero, every work ring
+// entry has a data slot of data_size bytes (entry i & mask uses slot i & mask),
+// into which the iso packets and the OUT payload are copied, if they fit, so
+// that USB_VHCI_HCD_IOCFETCHDATA isn't needed.
+// The completion ring is filled by user space and is processed by
+// USB_VHCI_HCD_IOCRING_DOORBELL. In addition, it is processed whenever new work
+// gets posted, so a busy consumer doesn't need the doorbell. The pointers in
+// the completion ring always refer to the address space of the process which
+// set up the rings.)
+struct usb_vhci_ioc_setup_rings
+{
+	__u32 work_entries;     // [in]  number of entries of the work ring
+	                        // [out] rounded up to a power of two
+	__u32 giveback_entries; // [in]  number of entries of the completion ring
+	                        // [out] rounded up to a power of two
+	__u32 work_ring;        // [out] offset of the header of the work ring
+	__u32 giveback_ring;    // [out] offset of the header of the completion ring
+	__u32 work_offset;      // [out] offset of the first entry of the work ring
+	__u32 giveback_offset;  // [out] offset of the first entry of the completion
+	                        //       ring
+	__u32 size;             // [out] number of bytes to map
+	__u32 data_size;        // [in]  number of bytes per data slot (0 = none)
+	                        // [out] rounded up to a multiple of 8
+	__u32 data_offset;      // [out] offset of the first data slot
+};
+#define USB_VHCI_RING_MAX_ENTRIES 1024
+#define USB_VHCI_RING_MAX_DATA    (sizeof(struct usb_vhci_ring_data) + \
+                                   USB_VHCI_WORK_DATA_MAX_PACKETS * \
+                                   sizeof(struct usb_vhci_ioc_iso_packet_data) + \
+                                   USB_VHCI_WORK_DATA_MAX_BUFFER)
+
+// structure for the USB_VHCI_HCD_IOCRING_DOORBELL ioctl
+struct usb_vhci_ioc_ring_doorbell
+{
+	__s16 timeout;          // [in]  timeout in milliseconds (max. 1000) for
+	                        //       waiting for entries in the work ring
+};
+
+// The data window is mapped by mmap at this offset (read-only, MAP_SHARED, at
+// most USB_VHCI_DATA_WINDOW_MAX bytes). It stays empty until
+// USB_VHCI_HCD_IOCMAPDATA maps the transfer buffer of an urb into it. The
+// pages are unmapped again, when the urb is given back or when its
+// cancelation is fetched.
+#define USB_VHCI_MMAP_DATA_OFFSET 0x10000000
+#define USB_VHCI_DATA_WINDOW_MAX  0x04000000
+
+// structure for the USB_VHCI_HCD_IOCMAPDATA ioctl
+// (Only OUT urbs, whose payload consists of whole pages, can be mapped; the
+// ioctl fails with EOPNOTSUPP for all other urbs. Use
+// USB_VHCI_HCD_IOCFETCHDATA for them. For control urbs, the payload is the
+// first wLength bytes of the transfer buffer.)
+struct usb_vhci_ioc_map_data
+{
+	__u64 handle;         // [in]  handle of a fetched urb
+	__u64 offset;         // [out] offset of the data inside the data window
+	__s32 buffer_length;  // [out] number of valid bytes at offset
+	__u32 reserved;
+};
+// maximum number of urbs which can be mapped at the same time
+#define USB_VHCI_DATA_MAX_MAPS 64
+
+// entry of the array which is passed to USB_VHCI_HCD_IOCREGISTER_BUFFERS
+// (pointers are stored as 64 bit values)
+struct usb_vhci_ioc_buffer
+{
+	__u64 address;       // start of the buffer in user space
+	__u32 length;        // number of bytes (max. USB_VHCI_FIXED_BUFFER_MAX)
+	__u32 reserved;
+};
+
+// structure for the USB_VHCI_HCD_IOCREGISTER_BUFFERS ioctl
+// (The pages of the buffers are pinned until they are replaced by the next
+// call or until the file is closed. A count of zero unregisters all buffers.
+// The buffers should not be shared with a child process after fork.)
+struct usb_vhci_ioc_register_buffers
+{
+	__u64 buffers;       // [in] array of struct usb_vhci_ioc_buffer
+	__u32 count;         // [in] number of entries (max. USB_VHCI_FIXED_BUFFERS_MAX)
+	__u32 reserved;
+};
+#define USB_VHCI_FIXED_BUFFERS_MAX 16
+#define USB_VHCI_FIXED_BUFFER_MAX  0x00100000
+
+// structure for the USB_VHCI_HCD_IOCGIVEBACK_FIXED ioctl
+// (Same as struct usb_vhci_ioc_giveback, but the received data of IN urbs is
+// taken from a buffer which was registered by USB_VHCI_HCD_IOCREGISTER_BUFFERS.)
+struct usb_vhci_ioc_giveback_fixed
+{
+	__u64 handle;
+	__u64 iso_packets;   // pointer to struct usb_vhci_ioc_iso_packet_giveback[]
+	__s32 status;
+	__s32 buffer_actual;
+	__s32 packet_count;
+	__s32 error_count;
+	__u32 buffer_index;  // index of the registered buffer
+	__u32 buffer_offset; // offset of the data inside of the registered buffer
+};
+
+// structure for the USB_VHCI_HCD_IOCGIVEBACK_FD ioctl
+// (Same as USB_VHCI_HCD_IOCGIVEBACK for a non-isochronous IN urb, but the data
+// is read from the file descriptor fd directly into the transfer buffer of the
+// urb. A negative offset reads from the current file position, which is what
+// pipes and sockets need. The urb can still be canceled while the read
+// blocks. If the read fails, its error is returned and the urb is given back
+// anyway, with status -EPROTO, like USB_VHCI_HCD_IOCGIVEBACK consumes the urb
+// on errors.)
+struct usb_vhci_ioc_giveback_fd
+{
+	__u64 handle;
+	__s64 offset;        // [in]  file offset
+	__s32 fd;            // [in]
+	__s32 status;        // [in]
+	__s32 buffer_actual; // [in]  number of bytes to read
+	                     // [out] number of bytes which were read
+	__s32 error_count;   // [in]
+};
+
+// structure for the USB_VHCI_HCD_IOCFETCHDATA_FD ioctl
+// (Writes the data of a non-isochronous OUT urb directly from its transfer
+// buffer to the file descriptor fd.)
+struct usb_vhci_ioc_fetch_data_fd
+{
+	__u64 handle;
+	__s64 offset;        // [in]  file offset (negative: current file position)
+	__s32 fd;            // [in]
+	__s32 written;       // [out] number of bytes which were written
+};
+
+struct iovec;
+
+// structure for the USB_VHCI_HCD_IOCFETCHDATA_IOV ioctl
+// (Same as struct usb_vhci_ioc_urb_data, but the OUT data is scattered over
+// iov_count segments.)
+struct usb_vhci_ioc_urb_data_iov
+{
+	__u64 handle;
+	const struct iovec *iov;
+	struct usb_vhci_ioc_iso_packet_data *iso_packets;
+	__s32 iov_count;     // max. USB_VHCI_IOV_MAX
+	__s32 packet_count;
+};
+
+// structure for the USB_VHCI_HCD_IOCGIVEBACK_IOV ioctl
+// (Same as struct usb_vhci_ioc_giveback, but the received data of IN urbs is
+// gathered from iov_count segments: buffer_actual bytes are taken from the
+// segments in order.)
+struct usb_vhci_ioc_giveback_iov
+{
+	__u64 handle;
+	const struct iovec *iov;
+	const struct usb_vhci_ioc_iso_packet_giveback *iso_packets;
+	__s32 iov_count;     // max. USB_VHCI_IOV_MAX
+	__s32 status;
+	__s32 buffer_actual;
+	__s32 packet_count;
+	__s32 error_count;
+	__u32 reserved;
+};
+#define USB_VHCI_IOV_MAX 64
+
+// structure for the USB_VHCI_HCD_IOCSET_BUSY_POLL ioctl
+// (The fetch ioctls of this file descriptor spin for up to budget_us
+// microseconds, waiting for work, before they go to sleep. The budget is only
+// spent while work has recently been arriving at least that fast. Zero turns
+// busy-polling off, which is the default.)
+struct usb_vhci_ioc_busy_poll
+{
+	__u32 budget_us;     // max. USB_VHCI_BUSY_POLL_MAX
+	__u32 reserved;
+};
+#define USB_VHCI_BUSY_POLL_MAX 10000
+
+// structure for the USB_VHCI_HCD_IOCFETCHWORK_NS ioctl
+// (Same as USB_VHCI_HCD_IOCFETCHWORK, but the timeout is given in nanoseconds,
+// it is not limited to one second and it is handled by a high-resolution
+// timer. work.timeout is ignored.)
+struct usb_vhci_ioc_work_ns
+{
+	__s64 timeout_ns;              // [in] 0 only checks; negative waits forever
+	__u32 flags;                   // [in] USB_VHCI_TIMEOUT_*
+	__u32 reserved;
+	struct usb_vhci_ioc_work work; // [out]
+};
+#define USB_VHCI_TIMEOUT_NS_INFINITE -1
+#define USB_VHCI_TIMEOUT_ABS      0x01 // timeout_ns is a point in time of the
+                                       // selected clock
+#define USB_VHCI_TIMEOUT_REALTIME 0x02 // use CLOCK_REALTIME instead of
+                                       // CLOCK_MONOTONIC
+
+// structure for the USB_VHCI_HCD_IOCSET_EVENTFD ioctl
+// (The eventfd is signaled whenever the controller goes from having no work
+// to having work, so it has to be drained completely (until FETCHWORK fails
+// with ETIMEDOUT or ENODATA) before waiting on the eventfd again. If there is
+// work already, it is signaled immediately. A negative fd detaches it.)
+struct usb_vhci_ioc_eventfd
+{
+	__s32 fd;
+	__u32 reserved;
+};
+
+// Records for read and write on the character device. Every record starts at
+// a multiple of USB_VHCI_RECORD_ALIGN bytes; length doesn't include the
+// padding.
+
+// read returns a stream of these records
+// (readv and aio reads fill the segments one after the other, each with
+// complete records, and stop after the first segment which isn't filled
+// completely.)
+struct usb_vhci_work_record
+{
+	__u32 length;                  // number of bytes of this record
+	__u8 flags;                    // USB_VHCI_WORK_DATA_INLINED if the iso
+	                               // packets and the OUT payload follow
+	__u8 reserved[3];
+	struct usb_vhci_ioc_work work; // same as for USB_VHCI_HCD_IOCFETCHWORK
+	// followed by work.urb.packet_count entries of
+	// struct usb_vhci_ioc_iso_packet_data and by the payload
+	// (only if USB_VHCI_WORK_DATA_INLINED is set)
+};
+
+// write takes a stream of these records
+// (It stops at the first record which fails. If that is the first record, its
+// error is returned; otherwise write returns the number of bytes before it,
+// and the next write returns its error. A failed record is consumed, like
+// with USB_VHCI_HCD_IOCGIVEBACK, unless the error is ENOENT or EBUSY.)
+struct usb_vhci_giveback_record
+{
+	__u32 length;        // number of bytes of this record
+	__s32 status;        // same as in struct usb_vhci_ioc_giveback
+	__u64 handle;
+	__s32 buffer_actual;
+	__s32 packet_count;
+	__s32 error_count;
+	__u32 reserved;
+	// followed by packet_count entries of
+	// struct usb_vhci_ioc_iso_packet_giveback and (only for IN urbs) by
+	// buffer_actual bytes of received data
+};
+#define USB_VHCI_RECORD_ALIGN      8
+// read never returns more than this number of bytes per call
+#define USB_VHCI_RECORD_BUFFER_MAX 16384
+
 #ifdef __KERNEL__
 #ifdef CONFIG_COMPAT
 #include <linux/compat.h>
@@ -200,6 +549,62 @@ struct usb_vhci_ioc_giveback32
 	__s32 packet_count;
 	__s32 error_count;
 };
+
+struct usb_vhci_ioc_work_batch32
+{
+	compat_caddr_t work;
+	__s32 count;
+	__s16 timeout;
+};
+
+struct usb_vhci_ioc_giveback_batch32
+{
+	compat_caddr_t giveback;
+	compat_caddr_t result;
+	__s32 count;
+};
+
+struct usb_vhci_ioc_work_data32
+{
+	struct usb_vhci_ioc_work work;
+	compat_caddr_t buffer;
+	compat_caddr_t iso_packets;
+	__s32 buffer_length;
+	__s32 packet_count;
+	__u8 flags;
+};
+
+struct usb_vhci_ioc_giveback_fetch32
+{
+	compat_caddr_t giveback;
+	compat_caddr_t result;
+	compat_caddr_t work;
+	__s32 count;
+	__s32 work_count;
+	__s16 timeout;
+};
+
+struct usb_vhci_ioc_urb_data_iov32
+{
+	__u64 handle;
+	compat_caddr_t iov;
+	compat_caddr_t iso_packets;
+	__s32 iov_count;
+	__s32 packet_count;
+};
+
+struct usb_vhci_ioc_giveback_iov32
+{
+	__u64 handle;
+	compat_caddr_t iov;
+	compat_caddr_t iso_packets;
+	__s32 iov_count;
+	__s32 status;
+	__s32 buffer_actual;
+	__s32 packet_count;
+	__s32 error_count;
+	__u32 reserved;
+};
 #endif
 #endif
 
@@ -221,7 +626,51 @@ struct usb_vhci_ioc_giveback32
                                        struct usb_vhci_ioc_urb_data)
 #define USB_VHCI_HCD_IOCFETCHDATA32  _IOW (USB_VHCI_HCD_IOC_MAGIC, 4, \
                                        struct usb_vhci_ioc_urb_data32)
-#define USB_VHCI_HCD_IOC_MAXNR       4
+#define USB_VHCI_HCD_IOCFETCHWORK_BATCH   _IOWR(USB_VHCI_HCD_IOC_MAGIC, 5, \
+                                            struct usb_vhci_ioc_work_batch)
+#define USB_VHCI_HCD_IOCFETCHWORK_BATCH32 _IOWR(USB_VHCI_HCD_IOC_MAGIC, 5, \
+                                            struct usb_vhci_ioc_work_batch32)
+#define USB_VHCI_HCD_IOCGIVEBACK_BATCH    _IOWR(USB_VHCI_HCD_IOC_MAGIC, 6, \
+                                            struct usb_vhci_ioc_giveback_batch)
+#define USB_VHCI_HCD_IOCGIVEBACK_BATCH32  _IOWR(USB_VHCI_HCD_IOC_MAGIC, 6, \
+                                            struct usb_vhci_ioc_giveback_batch32)
+#define USB_VHCI_HCD_IOCFETCHWORK_DATA    _IOWR(USB_VHCI_HCD_IOC_MAGIC, 7, \
+                                            struct usb_vhci_ioc_work_data)
+#define USB_VHCI_HCD_IOCFETCHWORK_DATA32  _IOWR(USB_VHCI_HCD_IOC_MAGIC, 7, \
+                                            struct usb_vhci_ioc_work_data32)
+#define USB_VHCI_HCD_IOCGIVEBACK_FETCH    _IOWR(USB_VHCI_HCD_IOC_MAGIC, 8, \
+                                            struct usb_vhci_ioc_giveback_fetch)
+#define USB_VHCI_HCD_IOCGIVEBACK_FETCH32  _IOWR(USB_VHCI_HCD_IOC_MAGIC, 8, \
+                                            struct usb_vhci_ioc_giveback_fetch32)
+#define USB_VHCI_HCD_IOCSETUP_RINGS       _IOWR(USB_VHCI_HCD_IOC_MAGIC, 9, \
+                                            struct usb_vhci_ioc_setup_rings)
+#define USB_VHCI_HCD_IOCRING_DOORBELL     _IOW (USB_VHCI_HCD_IOC_MAGIC, 10, \
+                                            struct usb_vhci_ioc_ring_doorbell)
+#define USB_VHCI_HCD_IOCMAPDATA           _IOWR(USB_VHCI_HCD_IOC_MAGIC, 11, \
+                                            struct usb_vhci_ioc_map_data)
+#define USB_VHCI_HCD_IOCREGISTER_BUFFERS  _IOW (USB_VHCI_HCD_IOC_MAGIC, 12, \
+                                            struct usb_vhci_ioc_register_buffers)
+#define USB_VHCI_HCD_IOCGIVEBACK_FIXED    _IOW (USB_VHCI_HCD_IOC_MAGIC, 13, \
+                                            struct usb_vhci_ioc_giveback_fixed)
+#define USB_VHCI_HCD_IOCGIVEBACK_FD       _IOWR(USB_VHCI_HCD_IOC_MAGIC, 14, \
+                                            struct usb_vhci_ioc_giveback_fd)
+#define USB_VHCI_HCD_IOCFETCHDATA_FD      _IOWR(USB_VHCI_HCD_IOC_MAGIC, 15, \
+                                            struct usb_vhci_ioc_fetch_data_fd)
+#define USB_VHCI_HCD_IOCFETCHDATA_IOV     _IOW (USB_VHCI_HCD_IOC_MAGIC, 16, \
+                                            struct usb_vhci_ioc_urb_data_iov)
+#define USB_VHCI_HCD_IOCFETCHDATA_IOV32   _IOW (USB_VHCI_HCD_IOC_MAGIC, 16, \
+                                            struct usb_vhci_ioc_urb_data_iov32)
+#define USB_VHCI_HCD_IOCGIVEBACK_IOV      _IOW (USB_VHCI_HCD_IOC_MAGIC, 17, \
+                                            struct usb_vhci_ioc_giveback_iov)
+#define USB_VHCI_HCD_IOCGIVEBACK_IOV32    _IOW (USB_VHCI_HCD_IOC_MAGIC, 17, \
+                                            struct usb_vhci_ioc_giveback_iov32)
+#define USB_VHCI_HCD_IOCSET_BUSY_POLL     _IOW (USB_VHCI_HCD_IOC_MAGIC, 18, \
+                                            struct usb_vhci_ioc_busy_poll)
+#define USB_VHCI_HCD_IOCFETCHWORK_NS      _IOWR(USB_VHCI_HCD_IOC_MAGIC, 19, \
+                                            struct usb_vhci_ioc_work_ns)
+#define USB_VHCI_HCD_IOCSET_EVENTFD       _IOW (USB_VHCI_HCD_IOC_MAGIC, 20, \
+                                            struct usb_vhci_ioc_eventfd)
+#define USB_VHCI_HCD_IOC_MAXNR       20
 
 #endif
 